@@ -2,5 +2,11 @@
 
 from .ageo import *
 
+from . import bestline
+from . import binfile
 from . import calibration
+from . import geodisk
+from . import grid
+from . import latency
+from . import mstore
 from . import ranging
@@ -1,36 +1,25 @@
 """ageo - active geolocation library: core.
 """
 
-__all__ = ('Location', 'Map', 'Observation')
+__all__ = ('Location', 'Map', 'Observation', 'RegionGrid')
 
 import bisect
+import contextlib
 import functools
-import itertools
 import numpy as np
 import pyproj
 from scipy import sparse
-from shapely.geometry import Point, MultiPoint, Polygon, box as Box
-from shapely.ops import transform as sh_transform
+from shapely.geometry import Point, MultiPoint, box as Box
 import tables
 import math
+import os
+import pickle
 import sys
+import tempfile
 
-# scipy.sparse.find() materializes vectors which, in several cases
-# below, can be enormous.  This is slower, but more memory-efficient.
-# Code from https://stackoverflow.com/a/31244368/388520 with minor
-# modifications.
-def iter_csr_nonzero(matrix):
-    irepeat = itertools.repeat
-    return zip(
-        # reconstruct the row indices
-        itertools.chain.from_iterable(
-            irepeat(i, r)
-            for (i,r) in enumerate(matrix.indptr[1:] - matrix.indptr[:-1])
-        ),
-        # matrix.indices gives the column indices as-is
-        matrix.indices,
-        matrix.data
-    )
+from . import binfile
+from . import geodisk
+from . import grid
 
 def Disk(x, y, radius):
     return Point(x, y).buffer(radius)
@@ -42,16 +31,12 @@ def Disk(x, y, radius):
 # (blech).  Therefore, this library also consistently uses lon/lat
 # order and meters.
 
-# Coordinate transformations used by Location.centroid()
+# Coordinate transformations used by Location.centroid().  (The
+# forward transformation is done in bulk by ageo.grid.)
 wgs_proj  = pyproj.Proj("+proj=longlat +ellps=WGS84 +datum=WGS84 +no_defs")
 gcen_proj = pyproj.Proj("+proj=geocent +datum=WGS84 +units=m +no_defs")
-wgs_to_gcen = functools.partial(pyproj.transform, wgs_proj, gcen_proj)
 gcen_to_wgs = functools.partial(pyproj.transform, gcen_proj, wgs_proj)
 
-# ... and Location.area()
-cea_proj   = pyproj.Proj(proj='cea', ellps='WGS84', lon_0=0, lat_ts=0)
-wgs_to_cea = functools.partial(pyproj.transform, wgs_proj, cea_proj)
-
 # Smooth over warts in pyproj.Geod.inv(), which is vectorized
 # internally, but does not support numpy-style broadcasting, and
 # returns things we don't need.  The prebound _Inv and _Bcast are
@@ -62,26 +47,39 @@ def WGS84dist(lon1, lat1, lon2, lat2, *,
     _, _, dist = _Inv(*_Bcast(lon1, lat1, lon2, lat2))
     return dist
 
+# Number of grid cells whose distances to a reference point are
+# computed at once, when evaluating a ranging function.
+PVAL_CHUNK = 65536
+
 def cartesian2(a, b):
     """Cartesian product of two 1D vectors A and B."""
     return np.tile(a, len(b)), np.repeat(b, len(a))
 
-def mask_ij(bounds, longitudes, latitudes):
+def mask_range(bounds, longitudes, latitudes):
     """Given a rectangle-tuple BOUNDS (west, south, east, north; as
        returned by shapely .bounds properties), and sorted grid index
-       vectors LONGITUDES, LATITUDES, return vectors I, J which give the
-       x- and y-indices of every grid point within the rectangle.
-       LATITUDES and LONGITUDES must be sorted.
+       vectors LONGITUDES, LATITUDES, return a tuple (min_i, max_i,
+       min_j, max_j) such that the grid points within the rectangle
+       are exactly those with min_i <= i < max_i, min_j <= j < max_j.
     """
     try:
         (west, south, east, north) = bounds
     except ValueError as e:
         raise ValueError("invalid bounds argument {!r}".format(bounds)) from e
 
-    min_i = bisect.bisect_left(longitudes, west)
-    max_i = bisect.bisect_right(longitudes, east)
-    min_j = bisect.bisect_left(latitudes, south)
-    max_j = bisect.bisect_right(latitudes, north)
+    return (bisect.bisect_left(longitudes, west),
+            bisect.bisect_right(longitudes, east),
+            bisect.bisect_left(latitudes, south),
+            bisect.bisect_right(latitudes, north))
+
+def mask_ij(bounds, longitudes, latitudes):
+    """Given a rectangle-tuple BOUNDS (west, south, east, north; as
+       returned by shapely .bounds properties), and sorted grid index
+       vectors LONGITUDES, LATITUDES, return vectors I, J which give the
+       x- and y-indices of every grid point within the rectangle.
+       LATITUDES and LONGITUDES must be sorted.
+    """
+    min_i, max_i, min_j, max_j = mask_range(bounds, longitudes, latitudes)
 
     I = np.array(range(min_i, max_i))
     J = np.array(range(min_j, max_j))
@@ -97,6 +95,43 @@ def mask_matrix(bounds, longitudes, latitudes):
     return sparse.csr_matrix((np.ones_like(I), (I, J)),
                              shape=(len(longitudes), len(latitudes)))
 
+def _csr_extent(matrix):
+    """Return [min_i, max_i, min_j, max_j], the range of row and column
+       indices of the positive entries of the CSR matrix MATRIX, or
+       None if it has no positive entries."""
+    pos = matrix.data > 0
+    if not pos.any():
+        return None
+    I = grid.csr_row_indices(matrix)[pos]
+    J = matrix.indices[pos]
+    return [int(I.min()), int(I.max()), int(J.min()), int(J.max())]
+
+# Magic number, current version, and conventional file name suffix of
+# the binary format for saved Location objects.  See Location.save_binary.
+LOCATION_MAGIC   = b"AGEOLOC\0"
+LOCATION_VERSION = 1
+LOCATION_SUFFIX  = ".agl"
+
+# Magic number and current version of the binary format used by
+# Map.share.  These files are not meant to outlive the process that
+# wrote them.
+MAP_MAGIC        = b"AGEOMAP\0"
+MAP_VERSION      = 1
+
+# Likewise for RegionGrid.share.
+REGIONS_MAGIC    = b"AGEORGN\0"
+REGIONS_VERSION  = 1
+
+# Directory for the files written by Location.share.  /dev/shm is
+# memory-backed on Linux, so the files never need to touch the disk.
+SHARED_DIR = "/dev/shm" if os.path.isdir("/dev/shm") else None
+
+def _shared_fname(prefix, suffix):
+    fd, fname = tempfile.mkstemp(prefix=prefix, suffix=suffix,
+                                 dir=SHARED_DIR)
+    os.close(fd)
+    return fname
+
 class LocationRowOnDisk(tables.IsDescription):
     """The row format of the pytables table used to save Location objects
        on disk.  See Location.save and Location.load."""
@@ -168,6 +203,7 @@ class Location:
         self._rep_pt      = rep_pt
         self._loaded_from = loaded_from
         self._area        = None
+        self._cell_index  = None
         self.annotations  = annotations if annotations is not None else {}
 
     @property
@@ -199,50 +235,7 @@ class Location:
         """Weighted area of the nonzero region of the probability matrix."""
 
         if self._area is None:
-            # Notionally, each grid point should be treated as a
-            # rectangle of parallels and meridians _centered_ on the
-            # point.  The area of such a rectangle, however, only
-            # depends on its latitude and its breadth; the actual
-            # longitude values don't matter.  Since the grid is
-            # equally spaced, we can use [0],[1] always, and then we
-            # do not have to worry about crossing the discontinuity at ±180.
-            west = self.longitudes[0]
-            east = self.longitudes[1]
-            # For latitude, the actual values do matter, but the map
-            # never goes all the way to the poles, and the grid is
-            # equally spaced, so we can precompute the north-south
-            # delta from any pair of latitudes and not have to worry
-            # about running off the ends of the array.
-            d_lat = (self.latitudes[1] - self.latitudes[0]) / 2
-
-            # We don't need X, so throw it away immediately.  (We
-            # don't use iter_csr_nonzero here because we need to
-            # modify V.)
-            X, Y, V = sparse.find(self.probability); X = None
-
-            # The value vector is supposed to be normalized, but make
-            # sure it is, and then adjust from 1-overall to 1-per-cell
-            # normalization.
-            assert len(V.shape) == 1
-            S = V.sum()
-            if S == 0:
-                return 0
-            if S != 1:
-                V /= S
-            V *= V.shape[0]
-
-            area = 0
-            for y, v in zip(Y, V):
-                north = self.latitudes[y] + d_lat
-                south = self.latitudes[y] - d_lat
-                if not (-90 <= south < north <= 90):
-                    raise AssertionError("expected -90 <= {} < {} <= 90"
-                                         .format(south, north))
-
-                tile = sh_transform(wgs_to_cea, Box(west, south, east, north))
-                area += v * tile.area
-
-            self._area = area
+            self.compute_moments_now()
         return self._area
 
     @property
@@ -252,64 +245,42 @@ class Location:
            the one closest to the centroid.
         """
         if self._rep_pt is None:
-            lons = self.longitudes
-            lats = self.latitudes
             cen = self.centroid
-            aeqd_cen = pyproj.Proj(proj='aeqd', ellps='WGS84', datum='WGS84',
-                                   lon_0=cen[0], lat_0=cen[1])
-            wgs_to_aeqd = functools.partial(pyproj.transform,
-                                            wgs_proj, aeqd_cen)
-            # mathematically, wgs_to_aeqd(Point(lon, lat)) == Point(0, 0);
-            # the latter is faster and more precise
-            cen_pt = Point(0,0)
+            M = self.probability
 
             # It is unacceptably costly to construct a shapely MultiPoint
             # out of some locations with large regions (can require more than
-            # 32GB of scratch memory).  Instead, iterate over the points
-            # one at a time.
-            max_prob = 0
-            min_dist = math.inf
+            # 32GB of scratch memory).  Instead, index just the cells with
+            # the greatest probability and query the index.
             rep_pt = None
-            for x, y, v in iter_csr_nonzero(self.probability):
-                lon = lons[x]
-                lat = lats[y]
-                if rep_pt is None or v > max_prob - epsilon:
-                    dist = WGS84dist(cen[0], cen[1], lon, lat)
-                    # v < max_prob has already been excluded
-                    if (rep_pt is None or v > max_prob or
-                        (v > max_prob - epsilon and dist < min_dist)):
-                        rep_pt = [lon, lat]
-                        max_prob = max(max_prob, v)
-                        min_dist = dist
+            if M.nnz:
+                index = grid.CellIndex(M, self.longitudes, self.latitudes,
+                                       select = M.data > M.data.max() - epsilon)
+                _, i, j = index.nearest(cen[0], cen[1])
+                if i is not None:
+                    rep_pt = np.array((self.longitudes[i], self.latitudes[j]))
 
             if rep_pt is None:
                 rep_pt = cen
-            else:
-                rep_pt = np.array(rep_pt)
             self._rep_pt = rep_pt
         return self._rep_pt
 
+    @property
+    def cell_index(self):
+        """Index over the nonzero cells of the probability matrix
+           (see ageo.grid.CellIndex)."""
+        if self._cell_index is None:
+            self._cell_index = grid.CellIndex(self.probability,
+                                              self.longitudes,
+                                              self.latitudes)
+        return self._cell_index
+
     def distance_to_point(self, lon, lat):
         """Find the shortest geodesic distance from (lon, lat) to a nonzero
-           cell of the probability matrix."""
-        aeqd_pt = pyproj.Proj(proj='aeqd', ellps='WGS84', datum='WGS84',
-                              lon_0=lon, lat_0=lat)
-        wgs_to_aeqd = functools.partial(pyproj.transform, wgs_proj, aeqd_pt)
-        # mathematically, wgs_to_aeqd(Point(lon, lat)) == Point(0, 0);
-        # the latter is faster and more precise
-        pt = Point(0, 0)
-
-        # It is unacceptably costly to construct a shapely MultiPoint
-        # out of some locations with large regions (requires more than
-        # 32GB of scratch memory).  Instead, iterate over the points
-        # one at a time.
-        min_distance = math.inf
-        for x, y, v in iter_csr_nonzero(self.probability):
-            cell = sh_transform(wgs_to_aeqd, Point(self.longitudes[x],
-                                                   self.latitudes[y]))
-            if pt.distance(cell) - self.resolution*2 < min_distance:
-                cell = cell.buffer(self.resolution * 3/2)
-                min_distance = min(min_distance, pt.distance(cell))
+           cell of the probability matrix.  Each cell is considered to
+           extend 3/2 of the grid resolution from its center."""
+        min_distance, _, _ = self.cell_index.nearest(lon, lat)
+        min_distance = max(0, min_distance - self.resolution * 3/2)
 
         if min_distance < self.resolution * 3/2:
             return 0
@@ -463,57 +434,62 @@ class Location:
            of the probability mass function.
         """
         if self._centroid is not None: return
+        self.compute_moments_now()
+
+    def compute_moments_now(self):
+        """Compute the weighted centroid, covariance matrix, and area
+           of the probability mass function, all in one pass over the
+           nonzero cells.  A centroid and covariance matrix that were
+           loaded from disk are not overwritten.
+        """
 
         # The centroid of a cloud of points is just the average of
         # their coordinates, but this only works correctly in
         # geocentric Cartesian space, not in lat/long space.
-
-        X = []
-        Y = []
-        Z = []
-        for i, j, v in iter_csr_nonzero(self.probability):
-            lon = self.longitudes[i]
-            lat = self.latitudes[j]
-            # PROJ.4 requires a dummy third argument when converting
-            # to geocentric (this appears to be interpreted as meters
-            # above/below the datum).
-            x, y, z = wgs_to_gcen(lon, lat, 0)
-            if math.isinf(x) or math.isinf(y) or math.isinf(z):
-                sys.stderr.write("wgs_to_gcen({}, {}, 0) = {}, {}, {}\n"
-                                 .format(lon, lat, x, y, z))
-            else:
-                X.append(x*v)
-                Y.append(y*v)
-                Z.append(z*v)
-
         # We leave the covariance matrix in geocentric terms, since
         # I'm not sure how to transform it back to lat/long space, or
         # if that even makes sense.
-        M = np.vstack((X, Y, Z))
-        self._covariance = np.cov(M)
+        total, covariance, area = grid.moments(
+            self.probability,
+            grid.grid_geometry(self.longitudes, self.latitudes))
+        self._area = area
+
+        if self._centroid is not None: return
 
         # Since the probability matrix is normalized, it is not
         # necessary to divide the weighted sums by anything to get
         # the means.
-        lon, lat, _ = gcen_to_wgs(*np.sum(M, 1))
+        lon, lat, _ = gcen_to_wgs(*total)
         if math.isinf(lat) or math.isinf(lon):
             raise ValueError("bogus centroid {}/{} - X={} Y={} Z={}"
-                             .format(lat, lon, X, Y, Z))
+                             .format(lat, lon, *total))
+        self._covariance = covariance
         self._centroid = np.array((lon, lat))
 
-    def save(self, fname):
-        """Write out this location to an HDF file.
-           For compactness, we write only the nonzero entries in a
-           pytables record form, and we _don't_ write out the full
-           longitude/latitude grid (it can be reconstructed from
-           the other metadata).
+    def save(self, fname, *, compress=False):
+        """Write out this location to disk.  If FNAME ends with
+           LOCATION_SUFFIX, the binary format is used (see save_binary;
+           COMPRESS is passed down); otherwise an HDF file is written.
+
+           For compactness, we write only the nonzero entries, and we
+           _don't_ write out the full longitude/latitude grid (it can
+           be reconstructed from the other metadata).
+        """
+        if fname.endswith(LOCATION_SUFFIX):
+            self.save_binary(fname, compress=compress)
+        else:
+            self.save_hdf(fname)
+
+    def save_hdf(self, fname):
+        """Write out this location to an HDF file, in pytables record form.
         """
         self.compute_centroid_now()
+        M = self.probability
 
         with tables.open_file(fname, mode="w", title="location") as f:
             t = f.create_table(f.root, "location",
                                LocationRowOnDisk, "location",
-                               expectedrows=self.probability.getnnz())
+                               expectedrows=M.getnnz())
             t.attrs.resolution  = self.resolution
             t.attrs.fuzz        = self.fuzz
             t.attrs.north       = self.north
@@ -530,63 +506,162 @@ class Location:
             if self.annotations:
                 t.attrs.annotations = self.annotations
 
-            cur = t.row
-            for i, j, pmass in iter_csr_nonzero(self.probability):
-                lon = self.longitudes[i]
-                lat = self.latitudes[j]
-                cur['grid_x']    = i
-                cur['grid_y']    = j
-                cur['longitude'] = lon
-                cur['latitude']  = lat
-                cur['prob_mass'] = pmass
-                cur.append()
-
+            I = grid.csr_row_indices(M)
+            J = M.indices
+            rows = np.empty(I.shape[0], dtype=t.dtype)
+            rows['grid_x']    = I
+            rows['grid_y']    = J
+            rows['longitude'] = self.longitudes[I]
+            rows['latitude']  = self.latitudes[J]
+            rows['prob_mass'] = M.data
+            t.append(rows)
             t.flush()
 
+    def save_binary(self, fname, *, compress=False):
+        """Write out this location in the binary format: the arrays of
+           the CSR probability matrix, stored contiguously so that
+           load() can memory-map them (see ageo.binfile), plus a header
+           with the grid parameters, centroid, covariance and bounding
+           rectangle.  If COMPRESS is true, the arrays are compressed,
+           which makes the file smaller but means it must be read
+           into memory rather than mapped.
+        """
+        self.compute_centroid_now()
+        M = self.probability.tocsr()
+        M.sum_duplicates()
+
+        if M.nnz < 2**31 and max(M.shape) < 2**31:
+            idx_dtype = np.int32
+        else:
+            idx_dtype = np.int64
+
+        extent = _csr_extent(M)
+        meta = {
+            "resolution":  float(self.resolution),
+            "fuzz":        float(self.fuzz),
+            "north":       float(self.north),
+            "south":       float(self.south),
+            "east":        float(self.east),
+            "west":        float(self.west),
+            "lon_spacing": float(self.lon_spacing),
+            "lat_spacing": float(self.lat_spacing),
+            "lon_count":   len(self.longitudes),
+            "lat_count":   len(self.latitudes),
+            "centroid":    [float(x) for x in self.centroid],
+            "covariance":  [[float(x) for x in row]
+                            for row in self.covariance],
+            "extent":      extent,
+        }
+        arrays = {
+            "indptr":  M.indptr.astype(idx_dtype),
+            "indices": M.indices.astype(idx_dtype),
+            "data":    M.data.astype(np.float32),
+        }
+        # Annotations can contain anything; pickle them, as pytables would.
+        if self.annotations:
+            arrays["annotations"] = np.frombuffer(
+                pickle.dumps(self.annotations, pickle.HIGHEST_PROTOCOL),
+                dtype=np.uint8)
+
+        binfile.write_arrays(fname, LOCATION_MAGIC, LOCATION_VERSION,
+                             meta, arrays, compress=compress)
+
+    def share(self):
+        """Write out this location to a new file in SHARED_DIR, in the
+           uncompressed binary format, and return the file's name.
+           Any number of processes can then attach() to the file and
+           will share a single read-only copy of the probability
+           matrix, which is not true of a copy inherited via fork()
+           (reference-count updates gradually unshare its pages).
+           The caller is responsible for removing the file; see
+           shared().
+        """
+        fname = _shared_fname("ageo-loc-", LOCATION_SUFFIX)
+        self.save_binary(fname)
+        return fname
+
+    @classmethod
+    def attach(cls, fname):
+        """Load a location written by share(), mapping its probability
+           matrix immediately rather than lazily."""
+        loc = cls.load(fname)
+        loc.compute_probability_matrix_now()
+        return loc
+
+    @contextlib.contextmanager
+    def shared(self):
+        """Context manager: share() this location for the duration of
+           a with-block, yielding the file name, and remove the file
+           afterward.  Processes that have already attached to it are
+           unaffected by the removal."""
+        fname = self.share()
+        try:
+            yield fname
+        finally:
+            os.unlink(fname)
+
+    def _set_loaded_pmatrix(self, M, extent):
+        """Set the probability matrix, vacuity and bounds of a location
+           that was loaded from disk.  EXTENT is the range of grid
+           indices of the nonzero cells, or None if there are none."""
+        if extent is None:
+            wb = eb = sb = nb = 0
+        else:
+            wb = self.longitudes[extent[0]]
+            eb = self.longitudes[extent[1]]
+            sb = self.latitudes[extent[2]]
+            nb = self.latitudes[extent[3]]
+
+        self._probability = M
+        self._vacuous = extent is None
+        self._bounds = Box(wb, sb, eb, nb)
+
     def _lazy_load_pmatrix(self):
         assert self._loaded_from is not None
+        if binfile.sniff(self._loaded_from, LOCATION_MAGIC):
+            self._lazy_load_pmatrix_binary()
+        else:
+            self._lazy_load_pmatrix_hdf()
+
+    def _lazy_load_pmatrix_binary(self):
+        _, meta, arrays = binfile.read_arrays(
+            self._loaded_from, LOCATION_MAGIC, LOCATION_VERSION,
+            names=("indptr", "indices", "data"))
+        M = sparse.csr_matrix(
+            (arrays["data"], arrays["indices"], arrays["indptr"]),
+            shape=(meta["lon_count"], meta["lat_count"]),
+            copy=False)
+        self._set_loaded_pmatrix(M, meta["extent"])
+
+    def _lazy_load_pmatrix_hdf(self):
         with tables.open_file(self._loaded_from, "r") as f:
             t = f.root.location
-            M = sparse.dok_matrix((t.attrs.lon_count, t.attrs.lat_count),
-                                  dtype=np.float32)
-            vacuous = True
-            negative_warning = False
-            for row in t.iterrows():
-                pmass = row['prob_mass']
-                # The occasional zero is normal, but negative numbers
-                # should never occur.
-                if pmass > 0:
-                    M[row['grid_x'], row['grid_y']] = pmass
-                    vacuous = False
-                elif pmass < 0:
-                    if not negative_warning:
-                        sys.stderr.write(fname + ": warning: negative pmass\n")
-                        negative_warning = True
-
-            M = M.tocsr()
-
-            if vacuous:
-                wb = 0
-                eb = 0
-                sb = 0
-                nb = 0
-            else:
-                i, j = M.nonzero()
-                wb = self.longitudes[i.min()]
-                eb = self.longitudes[i.max()]
-                sb = self.latitudes[j.min()]
-                nb = self.latitudes[j.max()]
+            rows = t.read()
+            pmass = rows['prob_mass']
 
-            self._probability = M
-            self._vacuous = vacuous
-            self._bounds = Box(wb, sb, eb, nb)
+            # The occasional zero is normal, but negative numbers
+            # should never occur.
+            if (pmass < 0).any():
+                sys.stderr.write(self._loaded_from +
+                                 ": warning: negative pmass\n")
+
+            keep = pmass > 0
+            M = sparse.csr_matrix(
+                (pmass[keep], (rows['grid_x'][keep], rows['grid_y'][keep])),
+                shape=(t.attrs.lon_count, t.attrs.lat_count),
+                dtype=np.float32)
+
+        self._set_loaded_pmatrix(M, _csr_extent(M))
 
     @classmethod
     def load(cls, fname):
-        """Read an HDF file containing a location (the result of save())
-           and instantiate a Location object from it.  The probability
-           matrix is lazily loaded.
+        """Read a file containing a location (the result of save()), in
+           either the binary or the HDF format, and instantiate a
+           Location object from it.  The probability matrix is lazily
+           loaded.
         """
+        if binfile.sniff(fname, LOCATION_MAGIC):
+            return cls._load_binary(fname)
 
         with tables.open_file(fname, "r") as f:
             t = f.root.location
@@ -613,6 +688,34 @@ class Location:
                 loaded_from = fname
             )
 
+    @classmethod
+    def _load_binary(cls, fname):
+        _, meta, arrays = binfile.read_arrays(
+            fname, LOCATION_MAGIC, LOCATION_VERSION,
+            names=("annotations",))
+        annotations = None
+        if "annotations" in arrays:
+            annotations = pickle.loads(arrays["annotations"].tobytes())
+
+        return cls(
+            resolution  = meta["resolution"],
+            fuzz        = meta["fuzz"],
+            north       = meta["north"],
+            south       = meta["south"],
+            east        = meta["east"],
+            west        = meta["west"],
+            lon_spacing = meta["lon_spacing"],
+            lat_spacing = meta["lat_spacing"],
+            longitudes  = np.linspace(meta["west"], meta["east"],
+                                      meta["lon_count"]),
+            latitudes   = np.linspace(meta["south"], meta["north"],
+                                      meta["lat_count"]),
+            centroid    = np.array(meta["centroid"]),
+            covariance  = np.array(meta["covariance"]),
+            annotations = annotations,
+            loaded_from = fname
+        )
+
 class Map(Location):
     """The map on which to locate a host.
 
@@ -630,7 +733,7 @@ class Map(Location):
             if M.shape[0] == len(M.attrs.longitudes):
                 baseline = sparse.csr_matrix(M)
             elif M.shape[1] == len(M.attrs.longitudes):
-                baseline = sparse.csr_matrix(M).T
+                baseline = sparse.csr_matrix(M).T.tocsr()
             else:
                 raise RuntimeError(
                     "mapfile matrix shape {!r} is inconsistent with "
@@ -668,6 +771,205 @@ class Map(Location):
                 vacuity     = False,
                 bounds      = bounds
             )
+        self._pyramid = None
+
+    @property
+    def pyramid(self):
+        """Occupancy pyramid of the baseline matrix (see
+           ageo.grid.OccupancyPyramid), used by Observation to skip
+           regions where the baseline is zero."""
+        if self._pyramid is None:
+            self._pyramid = grid.OccupancyPyramid(self.probability)
+        return self._pyramid
+
+    def share(self):
+        """Write out this map to a new file in SHARED_DIR and return the
+           file's name; see Location.share.  The longitude and latitude
+           vectors and the occupancy pyramid are included, so that
+           attached processes share those as well."""
+        M = self.probability.tocsr()
+        meta = {
+            "resolution":  float(self.resolution),
+            "fuzz":        float(self.fuzz),
+            "north":       float(self.north),
+            "south":       float(self.south),
+            "east":        float(self.east),
+            "west":        float(self.west),
+            "lon_spacing": float(self.lon_spacing),
+            "lat_spacing": float(self.lat_spacing),
+            "bounds":      list(self.bounds.bounds),
+            "levels":      len(self.pyramid),
+        }
+        arrays = {
+            "indptr":     M.indptr,
+            "indices":    M.indices,
+            "data":       M.data,
+            "longitudes": np.asarray(self.longitudes),
+            "latitudes":  np.asarray(self.latitudes),
+        }
+        for k, level in enumerate(self.pyramid.levels):
+            arrays["pyramid{}".format(k)] = level
+
+        fname = _shared_fname("ageo-map-", ".agm")
+        binfile.write_arrays(fname, MAP_MAGIC, MAP_VERSION, meta, arrays)
+        return fname
+
+    @classmethod
+    def attach(cls, fname):
+        """Load a map written by share().  All of its arrays are
+           read-only memory maps of the file."""
+        _, meta, arrays = binfile.read_arrays(fname, MAP_MAGIC, MAP_VERSION)
+        longitudes = arrays["longitudes"]
+        latitudes  = arrays["latitudes"]
+        baseline = sparse.csr_matrix(
+            (arrays["data"], arrays["indices"], arrays["indptr"]),
+            shape=(len(longitudes), len(latitudes)),
+            copy=False)
+
+        self = cls.__new__(cls)
+        Location.__init__(
+            self,
+            resolution  = meta["resolution"],
+            fuzz        = meta["fuzz"],
+            north       = meta["north"],
+            south       = meta["south"],
+            east        = meta["east"],
+            west        = meta["west"],
+            lon_spacing = meta["lon_spacing"],
+            lat_spacing = meta["lat_spacing"],
+            longitudes  = longitudes,
+            latitudes   = latitudes,
+            probability = baseline,
+            vacuity     = False,
+            bounds      = Box(*meta["bounds"])
+        )
+        self._pyramid = grid.OccupancyPyramid.from_levels(
+            [arrays["pyramid{}".format(k)] for k in range(meta["levels"])])
+        return self
+
+class RegionGrid:
+    """A division of a grid into labeled regions, such as countries,
+       for classifying points and locations by region.
+
+       The regions are stored as two dense matrices over the grid,
+       indexed like probability matrices: LABELS, which holds 1 + the
+       index of the region containing each cell, or 0 if there is
+       none, and WEIGHTS, which holds the probability assigned to the
+       cell by that region's Location.  Regions are assumed not to
+       overlap; where they do, the first one wins.
+    """
+
+    def __init__(self, names, labels, weights, longitudes, latitudes):
+        self.names      = list(names)
+        self.labels     = labels
+        self.weights    = weights
+        self.longitudes = longitudes
+        self.latitudes  = latitudes
+
+    @classmethod
+    def from_locations(cls, regions):
+        """Construct a RegionGrid from REGIONS, a list of (name, Location)
+           pairs.  All of the Locations must use the same grid."""
+        if len(regions) >= np.iinfo(np.int16).max:
+            raise ValueError("too many regions: {}".format(len(regions)))
+
+        _, first = regions[0]
+        shape = (len(first.longitudes), len(first.latitudes))
+        labels  = np.zeros(shape, dtype=np.int16)
+        weights = np.zeros(shape, dtype=np.float32)
+        for k, (_, rgn) in enumerate(regions):
+            M = rgn.probability.tocsr()
+            if M.shape != shape:
+                raise ValueError("can't combine regions with "
+                                 "inconsistent grids")
+            pos = M.data > 0
+            I = grid.csr_row_indices(M)[pos]
+            J = M.indices[pos]
+            free = labels[I, J] == 0
+            labels[I[free], J[free]] = k + 1
+            weights[I[free], J[free]] = M.data[pos][free]
+
+        return cls([name for name, _ in regions], labels, weights,
+                   np.asarray(first.longitudes), np.asarray(first.latitudes))
+
+    def region_containing(self, lon, lat):
+        """Index of the region containing or adjoining each point (LON,
+           LAT), under the same rule as Location.contains_point, or -1
+           if there is none.  LON and LAT may be scalars or vectors.
+           Where several regions adjoin a point, the first one wins."""
+        n_lon, n_lat = self.labels.shape
+        i = np.searchsorted(self.longitudes, lon, side='left')
+        j = np.searchsorted(self.latitudes, lat, side='left')
+        best = np.full(np.shape(i), np.iinfo(np.int16).max, dtype=np.int32)
+        for di in (-1, 0, 1):
+            for dj in (-1, 0, 1):
+                lab = self.labels[np.clip(i + di, 0, n_lon - 1),
+                                  np.clip(j + dj, 0, n_lat - 1)]
+                best = np.where(lab > 0, np.minimum(best, lab), best)
+        return np.where(best < np.iinfo(np.int16).max, best - 1, -1)
+
+    def area_by_region(self, loc):
+        """The weighted area of the intersection of LOC with each region,
+           as a vector; this equals loc.intersection(region).area for
+           each region, but takes one pass over LOC's nonzero cells.
+           LOC must be on the same grid as this region grid."""
+        M = loc.probability.tocsr()
+        if (M.shape != self.labels.shape or
+            not np.array_equal(loc.longitudes, self.longitudes) or
+            not np.array_equal(loc.latitudes, self.latitudes)):
+            raise ValueError("can't intersect location with region grid: "
+                             "inconsistent grids")
+        I = grid.csr_row_indices(M)
+        J = M.indices
+        lab = self.labels[I, J]
+        V = M.data.astype(np.float64) * self.weights[I, J]
+        keep = (lab > 0) & (V > 0)
+        lab = lab[keep]
+        V = V[keep]
+        J = J[keep]
+
+        n_rgn = len(self.names) + 1
+        geom = grid.grid_geometry(self.longitudes, self.latitudes)
+        count = np.bincount(lab, minlength=n_rgn)
+        total = np.bincount(lab, weights=V, minlength=n_rgn)
+        wsum  = np.bincount(lab, weights=V * geom.cell_area[J],
+                            minlength=n_rgn)
+
+        # See grid.moments for the weighting.
+        area = np.zeros(n_rgn)
+        nz = total > 0
+        area[nz] = count[nz] * wsum[nz] / total[nz]
+        return area[1:]
+
+    def share(self):
+        """Write out this region grid to a new file in SHARED_DIR and
+           return the file's name; see Location.share."""
+        fname = _shared_fname("ageo-rgn-", ".agr")
+        binfile.write_arrays(
+            fname, REGIONS_MAGIC, REGIONS_VERSION,
+            { "names": self.names },
+            { "labels":     self.labels,
+              "weights":    self.weights,
+              "longitudes": self.longitudes,
+              "latitudes":  self.latitudes })
+        return fname
+
+    @classmethod
+    def attach(cls, fname):
+        """Load a region grid written by share()."""
+        _, meta, arrays = binfile.read_arrays(fname, REGIONS_MAGIC,
+                                              REGIONS_VERSION)
+        return cls(meta["names"], arrays["labels"], arrays["weights"],
+                   arrays["longitudes"], arrays["latitudes"])
+
+    @contextlib.contextmanager
+    def shared(self):
+        """Context manager: see Location.shared."""
+        fname = self.share()
+        try:
+            yield fname
+        finally:
+            os.unlink(fname)
 
 class Observation(Location):
     """A single observation of the distance to a host.
@@ -681,12 +983,19 @@ class Observation(Location):
        round-trip times.
 
        Both the bounds and the probability matrix are computed lazily.
+       The probability matrix is computed coarse-to-fine (see
+       ageo.grid.refine_cells), so that the ranging function is only
+       evaluated in the parts of the bounding region where it might
+       be nonzero.  If WITHIN_BASEMAP is true, it is also not
+       evaluated where the map's baseline is zero; use this only if
+       the result will eventually be intersected with the map.
 
     """
 
     def __init__(self, *,
                  basemap, ref_lon, ref_lat,
-                 range_fn, calibration, rtts):
+                 range_fn, calibration, rtts,
+                 within_basemap=False):
 
         Location.__init__(
             self,
@@ -706,92 +1015,84 @@ class Observation(Location):
         self.calibration = calibration
         self.rtts        = rtts
         self.range_fn    = range_fn(calibration, rtts, basemap.fuzz)
+        self.pyramid     = basemap.pyramid if within_basemap else None
+        self._disk       = None
 
     def compute_bounding_region_now(self):
         if self._bounds is not None: return
 
         distance_bound = self.range_fn.distance_bound()
 
-        # If the distance bound is too close to half the circumference
-        # of the Earth, the projection operation below will produce an
-        # invalid polygon.  We don't get much use out of a bounding
-        # region that includes the whole planet but for a tiny disk
-        # (which will probably be somewhere in the ocean anyway) so
-        # just give up and say that the bound is the entire planet.
-        # Similarly, if the distance bound is zero, give up.
-        if distance_bound > 19975000 or distance_bound == 0:
+        # If the distance bound is zero, give up and say that the
+        # bound is the entire planet.
+        if distance_bound == 0:
             self._bounds = Box(self.west, self.south, self.east, self.north)
             return
 
-        # To find all points on the Earth within a certain distance of
-        # a reference latitude and longitude, back-project onto the
-        # Earth from an azimuthal-equidistant map with its zero point
-        # at the reference latitude and longitude.
-        aeqd = pyproj.Proj(proj='aeqd', ellps='WGS84', datum='WGS84',
-                           lat_0=self.ref_lat, lon_0=self.ref_lon)
+        # The bounding rectangle of the disk is found analytically
+        # (see geodisk.cap_bounds); it covers all longitudes if the disk
+        # contains a pole or crosses the antimeridian.  It is only the
+        # window in which the probability matrix is computed; whether
+        # disks overlap must be tested with .disk.
+        west, south, east, north = geodisk.cap_bounds(
+            self.ref_lon, self.ref_lat, distance_bound)
+        self._bounds = Box(max(west, self.west), max(south, self.south),
+                           min(east, self.east), min(north, self.north))
 
-        try:
-            disk = sh_transform(
-                functools.partial(pyproj.transform, aeqd, wgs_proj),
-                Disk(0, 0, distance_bound))
-
-            # Two special cases must be manually dealt with.  First, if
-            # any side of the "circle" (really a many-sided polygon)
-            # crosses the coordinate singularity at longitude ±180, we
-            # must replace it with a diversion to either the north or
-            # south pole (whichever is closer) to ensure that it still
-            # encloses all of the area it should.
-            boundary = np.array(disk.boundary)
-            i = 0
-            while i < boundary.shape[0] - 1:
-                if abs(boundary[i+1,0] - boundary[i,0]) > 180:
-                    pole = self.south if boundary[i,1] < 0 else self.north
-                    west = self.west if boundary[i,0] < 0 else self.east
-                    east = self.east if boundary[i,0] < 0 else self.west
-
-                    boundary = np.insert(boundary, i+1, [
-                        [west, boundary[i,1]],
-                        [west, pole],
-                        [east, pole],
-                        [east, boundary[i+1,1]]
-                    ], axis=0)
-                    i += 5
-                else:
-                    i += 1
-            # If there were two edges that crossed the singularity and they
-            # were both on the same side of the equator, the excursions will
-            # coincide and shapely will be unhappy.  buffer(0) corrects this.
-            disk = Polygon(boundary).buffer(0)
-
-            # Second, if the disk is very large, the projected disk might
-            # enclose the complement of the region that it ought to enclose.
-            # If it doesn't contain the reference point, we must subtract it
-            # from the entire map.
-            origin = Point(self.ref_lon, self.ref_lat)
-            if not disk.contains(origin):
-                disk = (Box(self.west, self.south, self.east, self.north)
-                        .difference(disk))
-
-            assert disk.is_valid
-            assert disk.contains(origin)
-            self._bounds = disk
-        except Exception as e:
-            setattr(e, 'offending_disk', disk)
-            setattr(e, 'offending_obs', self)
-            raise
+    @property
+    def disk(self):
+        """The region within the ranging function's distance bound of
+           the reference point, clipped to the map, as a polygon (see
+           geodisk.disk_polygon).  The bounds are only its bounding
+           rectangle, which covers all longitudes if the disk crosses
+           the antimeridian; use this to tell whether observations can
+           intersect at all."""
+        if self._disk is None:
+            whole = Box(self.west, self.south, self.east, self.north)
+            distance_bound = self.range_fn.distance_bound()
+            if distance_bound == 0:
+                self._disk = whole
+            else:
+                self._disk = geodisk.disk_polygon(
+                    self.ref_lon, self.ref_lat, distance_bound) \
+                    .intersection(whole)
+        return self._disk
+
+    def _may_be_nonzero(self, lon, lat, radius):
+        """Predicate for grid.refine_cells: can any point within RADIUS
+           of (LON, LAT) be at a distance from the reference point
+           where the ranging function is nonzero?"""
+        lo, hi = self.range_fn.support()
+        d = WGS84dist(self.ref_lon, self.ref_lat, lon, lat)
+        return (d - radius <= hi) & (d + radius >= lo)
 
     def compute_probability_matrix_within(self, bounds):
         if not bounds.is_empty and bounds.bounds != ():
 
-            I, J = mask_ij(bounds.intersection(self.bounds).bounds,
-                           self.longitudes,
-                           self.latitudes)
-
-            pvals = self.range_fn.unnormalized_pvals(
-                WGS84dist(self.ref_lon,
-                          self.ref_lat,
-                          self.longitudes[I],
-                          self.latitudes[J]))
+            extent = mask_range(bounds.intersection(self.bounds).bounds,
+                                self.longitudes, self.latitudes)
+            if self.pyramid is not None:
+                I, J = grid.refine_cells(
+                    self.longitudes, self.latitudes, extent,
+                    self._may_be_nonzero,
+                    pyramid=self.pyramid)
+            else:
+                lo, hi = self.range_fn.support()
+                I, J = geodisk.annulus_cells(
+                    self.longitudes, self.latitudes, extent,
+                    self.ref_lon, self.ref_lat, lo, hi)
+
+            # Evaluate the ranging function on each chunk of cells as
+            # soon as its distances are known, so that the only
+            # full-size array is the result.
+            kernel = self.range_fn.kernel()
+            pvals = np.empty(len(I))
+            for lo in range(0, len(I), PVAL_CHUNK):
+                hi = lo + PVAL_CHUNK
+                pvals[lo:hi] = kernel(WGS84dist(self.ref_lon,
+                                                self.ref_lat,
+                                                self.longitudes[I[lo:hi]],
+                                                self.latitudes[J[lo:hi]]))
 
             s = pvals.sum()
             if s:
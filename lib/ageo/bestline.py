@@ -0,0 +1,108 @@
+"""ageo.bestline - active geolocation library: CBG bestlines.
+
+The "bestline" of the CBG algorithm is the line that lies on or below
+every one of a set of calibration points (distance, RTT) and is as
+close to them as possible; see ageo.calibration.CBG.
+
+This module depends only on numpy and scipy, and does not import the
+rest of the ageo package, so that web/scripts/update_ripe_probes.py
+can use it too (web/lib/bestline.py is a link to this file).
+"""
+
+import math
+
+import numpy as np
+from scipy import optimize
+
+def solve_bestline(cx, cy, xbar, m_min, b_max):
+    """Find the line y = m*x + b which lies on or below every point
+       (CX[i], CY[i]), has slope m >= M_MIN and intercept 0 <= b <= B_MAX,
+       and, subject to those constraints, maximizes m*XBAR + b.
+       CX must be nonnegative and XBAR positive.
+
+       This is a linear program, but it can be solved exactly without
+       a general LP solver.  For any fixed m, the best b is
+       min(f(m), B_MAX), where f(m) = min_i (CY[i] - m*CX[i]) is the
+       intercept of the line of slope m supporting the lower convex
+       hull of the points.  The objective is therefore concave and
+       piecewise linear in m, with breakpoints at the slopes of the
+       hull's edges.  Where f(m) <= B_MAX its maximum is at the slope
+       of the hull edge spanning XBAR; where f(m) > B_MAX the
+       objective increases with m.  Clipping the edge slope to the
+       range of m where neither bound on b is violated or slack
+       gives the optimum.
+
+       Returns a scipy.optimize.OptimizeResult laid out like the
+       result of the equivalent optimize.linprog call: x is
+       [1, m, b] (coefficient 0 is a dummy), and success and message
+       are set appropriately.
+    """
+    cx = np.asarray(cx, dtype=np.float64)
+    cy = np.asarray(cy, dtype=np.float64)
+    if cx.shape[0] == 0 or not np.all(cx >= 0):
+        return optimize.OptimizeResult(
+            x=None, success=False, status=2,
+            message="distances must be nonnegative")
+
+    # Only the lowest point at each distance can matter.
+    order = np.lexsort((cy, cx))
+    px = cx[order]
+    py = cy[order]
+    first = np.ones(px.shape[0], dtype=bool)
+    first[1:] = px[1:] != px[:-1]
+    px = px[first]
+    py = py[first]
+
+    # Lower convex hull, by Andrew's monotone chain.
+    hull = []
+    for k in range(px.shape[0]):
+        while len(hull) >= 2:
+            i, j = hull[-2], hull[-1]
+            if ((px[j] - px[i]) * (py[k] - py[i]) -
+                (py[j] - py[i]) * (px[k] - px[i])) <= 0:
+                hull.pop()
+            else:
+                break
+        hull.append(k)
+    hx = px[hull]
+    hy = py[hull]
+
+    # f(m) >= 0 holds for m <= m_max; f(m) >= B_MAX for m <= m_cap.
+    # A point at distance zero bounds f from above regardless of m.
+    at_zero = px == 0
+    pos = ~at_zero
+    if at_zero.any() and py[0] < 0:
+        m_max = -math.inf
+    else:
+        m_max = np.amin(py[pos] / px[pos]) if pos.any() else math.inf
+    if at_zero.any() and py[0] < b_max:
+        m_cap = -math.inf
+    else:
+        m_cap = (np.amin((py[pos] - b_max) / px[pos]) if pos.any()
+                 else math.inf)
+
+    m_lo = max(m_min, m_cap)
+    if m_max < m_min or m_lo == math.inf:
+        return optimize.OptimizeResult(
+            x=None, success=False, status=2,
+            message="no line with slope >= {} passes below all points"
+                    .format(m_min))
+    if m_max == math.inf:
+        # Only points at distance zero: m is unconstrained above.
+        return optimize.OptimizeResult(
+            x=None, success=False, status=3,
+            message="no points at nonzero distance; problem is unbounded")
+
+    k = np.searchsorted(hx, xbar, side='left')
+    if k == 0:
+        m = -math.inf
+    elif k == hx.shape[0]:
+        m = math.inf
+    else:
+        m = (hy[k] - hy[k-1]) / (hx[k] - hx[k-1])
+    m = min(max(m, m_lo), m_max)
+    b = min(max(np.amin(hy - m * hx), 0), b_max)
+
+    return optimize.OptimizeResult(
+        x=np.array([1, m, b]), success=True, status=0,
+        message="Optimization terminated successfully.")
@@ -0,0 +1,147 @@
+"""ageo.binfile - active geolocation library: flat binary array files.
+
+A binary array file holds a small metadata header and any number of
+named numpy arrays, stored contiguously so that they can be
+memory-mapped back in without copying.  Arrays may optionally be
+compressed, block by block, at the cost of having to be decompressed
+into memory when loaded.
+
+Layout (all integers little-endian):
+
+    magic          8 bytes, chosen by the caller, identifies the content
+    version        uint32, chosen by the caller
+    header length  uint32
+    header         JSON object, UTF-8, padded with spaces
+    arrays         each one starting on an ALIGN-byte boundary
+
+The header object has two keys: "meta", which is whatever the caller
+supplied, and "arrays", which maps each array name to a description
+of where it is and how to decode it.
+"""
+
+import json
+import os
+import struct
+import zlib
+
+import numpy as np
+
+ALIGN = 64
+BLOCK_SIZE = 1 << 20   # elements per compressed block
+
+_PREFIX = struct.Struct("<8sII")
+
+class FormatError(ValueError):
+    pass
+
+def _aligned(n):
+    return (n + ALIGN - 1) // ALIGN * ALIGN
+
+def sniff(fname, magic):
+    """True if FNAME begins with the magic number MAGIC."""
+    try:
+        with open(fname, "rb") as fp:
+            return fp.read(len(magic)) == magic
+    except OSError:
+        return False
+
+def write_arrays(fname, magic, version, meta, arrays, *, compress=False):
+    """Write META (any JSON-serializable object) and ARRAYS (a mapping
+       from names to numpy arrays) to FNAME.  If COMPRESS is true, each
+       array is zlib-compressed in blocks of BLOCK_SIZE elements.
+       The file is written under a temporary name and then renamed
+       into place, so readers never see a partial file.
+    """
+    if len(magic) != 8:
+        raise ValueError("magic number must be 8 bytes long")
+
+    arrays = { name: np.ascontiguousarray(arr)
+               for name, arr in arrays.items() }
+    payloads = {}
+    directory = {}
+    for name, arr in arrays.items():
+        desc = { "dtype": arr.dtype.str, "shape": list(arr.shape) }
+        if compress and arr.size:
+            flat = arr.reshape(-1)
+            blocks = [zlib.compress(flat[i:i+BLOCK_SIZE].tobytes(), 6)
+                      for i in range(0, flat.shape[0], BLOCK_SIZE)]
+            desc["blocks"] = [len(b) for b in blocks]
+            desc["nbytes"] = sum(desc["blocks"])
+            payloads[name] = blocks
+        else:
+            desc["nbytes"] = arr.nbytes
+            payloads[name] = [arr]
+        directory[name] = desc
+
+    # The header records the offset of each array, which depends on
+    # the length of the header; pad generously so that one pass
+    # suffices.
+    def encode_header(pad):
+        return json.dumps({ "meta": meta, "arrays": directory },
+                          separators=(",",":"), sort_keys=True) \
+                   .encode("utf-8") + b" " * pad
+
+    hlen = _aligned(_PREFIX.size + len(encode_header(0)) + 32 * len(arrays))
+    offset = hlen
+    for name in sorted(directory.keys()):
+        directory[name]["offset"] = offset
+        offset = _aligned(offset + directory[name]["nbytes"])
+    header = encode_header(0)
+    header += b" " * (hlen - _PREFIX.size - len(header))
+    if _PREFIX.size + len(header) != hlen:
+        raise AssertionError("header overflowed its allotted space")
+
+    tmpname = fname + ".tmp"
+    with open(tmpname, "wb") as fp:
+        fp.write(_PREFIX.pack(magic, version, len(header)))
+        fp.write(header)
+        for name in sorted(directory.keys()):
+            fp.seek(directory[name]["offset"])
+            for chunk in payloads[name]:
+                fp.write(chunk)
+        fp.truncate(offset)
+    os.replace(tmpname, fname)
+
+def read_header(fname, magic, max_version):
+    """Read just the header of FNAME.  Returns (version, meta, directory)."""
+    with open(fname, "rb") as fp:
+        prefix = fp.read(_PREFIX.size)
+        if len(prefix) != _PREFIX.size:
+            raise FormatError("{}: file too short".format(fname))
+        fmagic, version, hlen = _PREFIX.unpack(prefix)
+        if fmagic != magic:
+            raise FormatError("{}: wrong magic number {!r}"
+                              .format(fname, fmagic))
+        if version > max_version:
+            raise FormatError("{}: unsupported version {}"
+                              .format(fname, version))
+        header = json.loads(fp.read(hlen).decode("utf-8"))
+    return version, header["meta"], header["arrays"]
+
+def read_arrays(fname, magic, max_version, *, names=None):
+    """Read FNAME.  Returns (version, meta, arrays), where ARRAYS maps
+       names to numpy arrays.  Uncompressed arrays are read-only memory
+       maps of the file; compressed ones are decompressed into memory.
+       If NAMES is not None, only those arrays are loaded.
+    """
+    version, meta, directory = read_header(fname, magic, max_version)
+    arrays = {}
+    for name, desc in directory.items():
+        if names is not None and name not in names:
+            continue
+        dtype = np.dtype(desc["dtype"])
+        shape = tuple(desc["shape"])
+        if "blocks" in desc:
+            parts = []
+            with open(fname, "rb") as fp:
+                fp.seek(desc["offset"])
+                for blen in desc["blocks"]:
+                    parts.append(np.frombuffer(zlib.decompress(fp.read(blen)),
+                                               dtype=dtype))
+            arrays[name] = np.concatenate(parts).reshape(shape)
+        elif desc["nbytes"] == 0:
+            arrays[name] = np.zeros(shape, dtype=dtype)
+        else:
+            arrays[name] = np.memmap(fname, dtype=dtype, mode="r",
+                                     offset=desc["offset"], shape=shape)
+    return version, meta, arrays
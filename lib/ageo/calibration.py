@@ -8,6 +8,7 @@ round-trip time.
 import collections
 from functools import partial
 import math
+import multiprocessing
 import warnings
 
 import numpy as np
@@ -15,6 +16,9 @@ from scipy import optimize, spatial, interpolate
 
 import sys
 
+from . import binfile
+from .bestline import solve_bestline
+
 # half of the equatorial circumference of the Earth, in meters
 # it is impossible for the target to be farther away than this
 DISTANCE_LIMIT = 20037508
@@ -182,38 +186,59 @@ class CBG(Calibration):
         if obs.shape[0] == 0:
             raise ValueError("not enough feasible observations")
 
+        # Only the minimum round-trip time observed at each distance
+        # can contribute to the solution, so that is all we keep.
+        # This is what makes update() cheap.
+        self._dists   = np.zeros(0)
+        self._minrtts = np.zeros(0)
+        self._merge(obs)
+        if self._dists.shape[0] == 0:
+            raise ValueError("not enough feasible observations")
+        self._fit()
+
+    def _merge(self, obs):
+        """Fold feasible observations OBS into the table of minimum
+           round-trip times at each distance."""
+
         # Also discard all observations at distance 0, CBG can't make
         # constructive use of them.
         obs = obs[obs[:,0] > 0, :]
 
+        dists, inv = np.unique(np.append(self._dists, obs[:,0]),
+                               return_inverse=True)
+        minrtts = np.full(dists.shape, math.inf)
+        np.minimum.at(minrtts, inv, np.append(self._minrtts, obs[:,1]))
+        self._dists   = dists
+        self._minrtts = minrtts
+
+    def _bins(self):
+        """Compute the data constraints: (cx, cy, xbar)."""
+
         # Split the feasible observations into bins, and take the
         # minimum round-trip time in each bin; only this time can
         # contribute to the solution.  This number of edges carves the
         # planet's half-circumference into roughly 25km intervals.
         # It's 804, not 800, for exact consistency with Spotter (see
         # below).
-        xs = obs[:,1] # rtts
-        ys = obs[:,0] # distances
+        ys = self._dists   # distances
+        xs = self._minrtts # rtts
         edges = np.linspace(ys[0], ys[-1], 804)
         binds = np.digitize(ys, edges)
         nbins = binds.max()-1
 
-        dists   = np.zeros(nbins)
-        minrtts = np.zeros(nbins)
-        for i in reversed(range(nbins)):
-            dists[i]   = (edges[i] + edges[i+1])/2
-            sel = binds == i+1
-            if any(sel):
-                minrtts[i] = np.amin(xs[sel])
-            elif i < nbins-1:
-                # optimize.linprog cannot cope with NaN; substitute
-                # the next higher observation, which will DTRT
-                minrtts[i] = minrtts[i+1]
-            else:
-                # there _is_ no next higher observation; substitute an
-                # artificial value (see below)
-                minrtts[i] = 237.16
-            assert minrtts[i] > 0
+        dists   = (edges[:nbins] + edges[1:nbins+1])/2
+        minrtts = np.full(nbins, math.inf)
+        sel = binds <= nbins
+        np.minimum.at(minrtts, binds[sel] - 1, xs[sel])
+
+        # An empty bin cannot be NaN; substitute the next higher
+        # observation, which will DTRT.  If there _is_ no next higher
+        # observation, substitute an artificial value (see below).
+        nonempty = np.isfinite(minrtts)
+        next_obs = np.minimum.accumulate(
+            np.where(nonempty, np.arange(nbins), nbins)[::-1])[::-1]
+        minrtts = np.append(minrtts, 237.16)[next_obs]
+        assert np.all(minrtts > 0)
 
         # The goal is to find m, b that minimize \sum_i (y_i - mx_i - b)
         # while still satisfying y_i \ge mx_i + b for all i.
@@ -233,38 +258,90 @@ class CBG(Calibration):
         #
         # This last ensures that the fit will not select a data point from
         # a satellite link as a defining point for the line.
+        #
+        # Minimizing 1Y - mX - bI is the same as maximizing m(X/I) + b,
+        # which solve_bestline does directly.
 
-        coef = np.array([np.sum(minrtts), -np.sum(dists), -len(dists)])
+        self.coef = np.array([np.sum(minrtts), -np.sum(dists), -len(dists)])
         cx = np.append(dists, DISTANCE_LIMIT)
         cy = np.append(minrtts, 237.16)
-        constr_A = np.column_stack((
-            np.zeros_like(cx), cx, np.ones_like(cx)
-        ))
-        constr_B = np.column_stack((cy,))
-        bounds = [(1,1), (1/100000, None), (0, np.amin(cy))]
-
-        self.cx = cx
-        self.cy = cy
-        self.coef = coef
-
-        fit = optimize.linprog(coef,
-                               A_ub=constr_A,
-                               b_ub=constr_B,
-                               bounds=bounds)
+        return cx, cy, np.mean(dists)
+
+    def _fit(self):
+        self.cx, self.cy, xbar = self._bins()
+        self._solve(xbar)
+
+    def _solve(self, xbar):
+        fit = solve_bestline(self.cx, self.cy, xbar,
+                             1/100000, np.amin(self.cy))
         warn_if_minimization_failed("CBG", fit)
         if fit.success:
             # The linear program found a "bestline", mapping distance to
             # latency.  The "max curve" is the inverse function of this
             # bestline, mapping latency to distance.  Coefficient 0 of the
             # fit is a dummy.
+            self._bestline = _Line(fit.x[1], fit.x[2])
             m = 1/fit.x[1]
             b = -m * fit.x[2]
             self._curve = {
                 'max': _Line(m, b),
                 'min': _Line(0, 0)
             }
+            self.__dict__.pop('fit', None)
         else:
             self.fit = fit
+            self.__dict__.pop('_curve', None)
+            self.__dict__.pop('_bestline', None)
+
+    def update(self, obs):
+        """Incorporate additional observations OBS (laid out as for the
+           constructor) into this calibration.  The result is the same
+           as if all of the observations had been supplied to the
+           constructor, but the bestline is only recomputed if the new
+           observations could change it: that is, if they move the
+           range of distances (and hence the bins), raise the minimum
+           of a bin that was previously empty, or land below the
+           current line.  Returns True, or False if this calibration
+           was reconstructed from its coefficients and so cannot be
+           updated.
+        """
+        if not hasattr(self, '_dists'):
+            return False
+        if obs.shape[0] == 0:
+            return True
+        obs = discard_infeasible(obs)
+        if obs.shape[0] == 0:
+            return True
+
+        old_range = (self._dists[0], self._dists[-1])
+        self._merge(obs)
+        cx, cy, xbar = self._bins()
+        if ((self._dists[0], self._dists[-1]) != old_range
+            or not hasattr(self, '_bestline')):
+            self.cx, self.cy = cx, cy
+            self._solve(xbar)
+            return True
+
+        changed = cy != self.cy
+        if not changed.any():
+            return True
+        must_solve = (np.any(cy[changed] > self.cy[changed]) or
+                      np.any(cy[changed] < self._bestline(cx[changed])))
+        self.cx, self.cy = cx, cy
+        if must_solve:
+            self._solve(xbar)
+        return True
+
+    @classmethod
+    def from_coefficients(cls, m, b):
+        """Reconstruct a CBG calibration from the coefficients of its
+           max curve (see CalibrationTable)."""
+        self = cls.__new__(cls)
+        self._curve = {
+            'max': _Line(m, b),
+            'min': _Line(0, 0)
+        }
+        return self
 
 class QuasiOctant(Calibration):
     """An algorithm derived from "Octant: A Comprehensive Framework for
@@ -365,6 +442,155 @@ class QuasiOctant(Calibration):
             'min': _PolyLine(lower_adjusted)
         }
 
+    @classmethod
+    def from_coefficients(cls, max_points, min_points):
+        """Reconstruct a QuasiOctant calibration from the vertices of
+           its max and min curves (see CalibrationTable)."""
+        self = cls.__new__(cls)
+        self._curve = {
+            'max': _PolyLine(np.array(max_points)),
+            'min': _PolyLine(np.array(min_points))
+        }
+        return self
+
+def _window_edges(xs, nknots):
+    return np.linspace(xs[0], xs[-1], nknots + 4)
+
+def _window_sums(xs, ys, edges, shift):
+    """Count the observations in each window [edges[i], edges[i+4]],
+       and sum YS - SHIFT and (YS - SHIFT)**2 over each window.  The
+       observations are sorted by XS once, after which the extent of
+       every window is found by binary search, and its sums are read
+       off prefix sums.  The sums are accumulated in extended
+       precision where the platform has it, to limit cancellation in
+       the variance.  Returns (count, s1, s2)."""
+    order = np.argsort(xs, kind='stable')
+    sx = xs[order]
+    sy = (ys[order] - shift).astype(np.longdouble)
+    p1 = np.zeros(sy.shape[0] + 1, dtype=np.longdouble)
+    p2 = np.zeros(sy.shape[0] + 1, dtype=np.longdouble)
+    np.cumsum(sy, out=p1[1:])
+    np.cumsum(sy * sy, out=p2[1:])
+
+    lo = np.searchsorted(sx, edges[:-4], side='left')
+    hi = np.maximum(np.searchsorted(sx, edges[4:], side='right'), lo)
+    return hi - lo, p1[hi] - p1[lo], p2[hi] - p2[lo]
+
+def _add_to_window_sums(xs, ys, edges, shift, count, s1, s2):
+    """Add observations (XS, YS) to window sums COUNT, S1, S2, in place.
+       Each observation falls into at most five windows."""
+    first = np.searchsorted(edges[4:], xs, side='left')
+    last  = np.searchsorted(edges[:-4], xs, side='right')
+    n = np.maximum(last - first, 0)
+    which = np.repeat(np.arange(xs.shape[0]), n)
+    window = (np.repeat(first, n) + np.arange(which.shape[0])
+              - np.repeat(np.cumsum(n) - n, n))
+    sy = (ys[which] - shift).astype(np.longdouble)
+    np.add.at(count, window, 1)
+    np.add.at(s1, window, sy)
+    np.add.at(s2, window, sy * sy)
+
+def _window_moments(knots, count, s1, s2, shift):
+    observed = count > 0
+    count = count[observed]
+    m1 = s1[observed] / count
+    m2 = s2[observed] / count
+    mu = (m1 + shift).astype(np.float64)
+    sigma = np.sqrt(np.maximum(m2 - m1 * m1, 0)).astype(np.float64)
+    return (knots[observed], mu, sigma)
+
+def windowed_moments(xs, ys, nknots=800):
+    """Compute the mean and standard deviation of YS within sliding
+       windows over XS.  The windows are [edges[i], edges[i+4]], where
+       EDGES divides the range from XS[0] to XS[-1] into NKNOTS + 3
+       equal intervals; the knot for each window is edges[i+2].  The
+       default number of edges carves the planet's half-circumference
+       into (roughly) 25km bins.  Returns (knots, mu, sigma), omitting
+       knots whose windows contain no observations.
+
+       XS need not be sorted.  YS is shifted by its mean before
+       summing, to limit cancellation in the variance.
+    """
+    xs = np.asarray(xs, dtype=np.float64)
+    ys = np.asarray(ys, dtype=np.float64)
+    edges = _window_edges(xs, nknots)
+    shift = ys.mean()
+    count, s1, s2 = _window_sums(xs, ys, edges, shift)
+    return _window_moments(edges[2:-2], count, s1, s2, shift)
+
+def _fit_cubic_constrained(xs, ys):
+    """Least-squares fit of an increasing cubic to (XS, YS); see Spotter."""
+
+    # The function to be minimized.  This is the least-squares
+    # error of a cubic polynomial with coefficients COEF,
+    # applied to data points (xs, ys).
+    def lse_cubic(coef, xs, ys):
+        zs = _Cubic(*coef)(xs)
+        resid = zs - ys
+        return resid.dot(resid)
+
+    # Any smooth function is increasing everywhere if and only if
+    # its derivative is positive everywhere.  The derivative of a
+    # cubic ax^3 + bx^2 + cx + d is a quadratic (3a)x^2 + (2b)x + c,
+    # and a quadratic Ax^2 + Bx + C is positive everywhere when
+    # A > 0 and B^2 - 4AC < 0 (that is, the parabola is concave
+    # upward and does not touch the x-axis).  minimize() wants
+    # inequality constraints of the form g(coef) >= 0.
+    def constr_concave_up(coef):
+        return coef[0]*3
+    def constr_det_negative(coef):
+        A = coef[0]*3
+        B = coef[1]*2
+        C = coef[2]
+        return -(B*B - 4*A*C)
+
+    # Scale the data to the unit square in both directions, to
+    # avoid "loss of precision" errors.
+    ymin   = ys.min()
+    ymax   = ys.max()
+    yrang  = ymax - ymin
+    if yrang == 0 or math.isnan(yrang):
+        import pprint
+        pprint.pprint(ys, stream=sys.stderr)
+        raise RuntimeError("wtf")
+    ryrang = 1/yrang
+
+    xmin   = xs.min()
+    xmax   = xs.max()
+    xrang  = xmax - xmin
+    if xrang == 0 or math.isnan(xrang):
+        import pprint
+        pprint.pprint(xs, stream=sys.stderr)
+        raise RuntimeError("wtf #2")
+    rxrang = 1/xrang
+
+    xss = (xs-xmin) * rxrang
+    yss = (ys-ymin) * ryrang
+
+    result = optimize.minimize(
+        fun    = lse_cubic,
+        args   = (xss, yss),
+        # initial linear approximation
+        x0     = np.array([0, 0, 1, 0]),
+        # require cubic to be increasing everywhere (see above)
+        constraints = [
+            { 'type': 'ineq', 'fun': constr_concave_up },
+            { 'type': 'ineq', 'fun': constr_det_negative }
+        ],
+        # require y-intercept to be nonnegative
+        bounds = [
+            (None, None), (None, None), (None, None), (0, None)
+        ],
+        # scipy 0.17.1's default method for constrained
+        # optimization; pinned for reproducibility
+        method = 'SLSQP',
+        # because of the constraints, the solver may need
+        # extra iterations
+        options = { 'maxiter': 10000 }
+    )
+    warn_if_minimization_failed("Spotter", result)
+    return _ScaledCubic(*result.x, xmin, ymin, rxrang, yrang)
+
 class Spotter(Calibration):
     """An algorithm derived from "Spotter: A Model-Based Active Geolocation
     Service", INFOCOM 2011.
@@ -392,114 +618,341 @@ class Spotter(Calibration):
         """OBS should be an N-by-2 matrix where the first column is distances
            and the second column is round-trip times."""
 
-        # The default number of edges carves the planet's
-        # half-circumference into (roughly) 25km bins.
-        def windowed_moments(xs, ys, nknots=800):
-            edges = np.linspace(xs[0], xs[-1], nknots + 4)
-            knots = edges[2:-2]
-            mu    = np.zeros_like(knots)
-            sigma = np.zeros_like(knots)
-            for i, (lo, hi) in enumerate(zip(edges[:-4], edges[4:])):
-                ind = (xs >= lo) & (xs <= hi)
-                blk = ys[ind]
-                if len(blk) > 0:
-                    mu[i] = np.mean(blk)
-                    sigma[i] = np.std(blk)
-                else:
-                    mu[i] = math.nan
-                    sigma[i] = math.nan
-
-            observed = np.isfinite(mu)
-            knots = knots[observed]
-            mu = mu[observed]
-            sigma = sigma[observed]
-            assert all(np.isfinite(sigma))
-            return (knots, mu, sigma)
-
-        def fit_cubic_constrained(xs, ys):
-
-            # The function to be minimized.  This is the least-squares
-            # error of a cubic polynomial with coefficients COEF,
-            # applied to data points (xs, ys).
-            def lse_cubic(coef, xs, ys):
-                zs = _Cubic(*coef)(xs)
-                resid = zs - ys
-                return resid.dot(resid)
-
-            # Any smooth function is increasing everywhere if and only if
-            # its derivative is positive everywhere.  The derivative of a
-            # cubic ax^3 + bx^2 + cx + d is a quadratic (3a)x^2 + (2b)x + c,
-            # and a quadratic Ax^2 + Bx + C is positive everywhere when
-            # A > 0 and B^2 - 4AC < 0 (that is, the parabola is concave
-            # upward and does not touch the x-axis).  minimize() wants
-            # inequality constraints of the form g(coef) >= 0.
-            def constr_concave_up(coef):
-                return coef[0]*3
-            def constr_det_negative(coef):
-                A = coef[0]*3
-                B = coef[1]*2
-                C = coef[2]
-                return -(B*B - 4*A*C)
-
-            # Scale the data to the unit square in both directions, to
-            # avoid "loss of precision" errors.
-            ymin   = ys.min()
-            ymax   = ys.max()
-            yrang  = ymax - ymin
-            if yrang == 0 or math.isnan(yrang):
-                import sys
-                import pprint
-                pprint.pprint(ys, stream=sys.stderr)
-                raise RuntimeError("wtf")
-            ryrang = 1/yrang
-
-            xmin   = xs.min()
-            xmax   = xs.max()
-            xrang  = xmax - xmin
-            if xrang == 0 or math.isnan(xrang):
-                import sys
-                import pprint
-                pprint.pprint(xs, stream=sys.stderr)
-                raise RuntimeError("wtf #2")
-            rxrang = 1/xrang
-
-            xss = (xs-xmin) * rxrang
-            yss = (ys-ymin) * ryrang
-
-            result = optimize.minimize(
-                fun    = lse_cubic,
-                args   = (xss, yss),
-                # initial linear approximation
-                x0     = np.array([0, 0, 1, 0]),
-                # require cubic to be increasing everywhere (see above)
-                constraints = [
-                    { 'type': 'ineq', 'fun': constr_concave_up },
-                    { 'type': 'ineq', 'fun': constr_det_negative }
-                ],
-                # require y-intercept to be nonnegative
-                bounds = [
-                    (None, None), (None, None), (None, None), (0, None)
-                ],
-                # scipy 0.17.1's default method for constrained
-                # optimization; pinned for reproducibility
-                method = 'SLSQP',
-                # because of the constraints, the solver may need
-                # extra iterations
-                options = { 'maxiter': 10000 }
-            )
-            warn_if_minimization_failed("Spotter", result)
-            return _ScaledCubic(*result.x, xmin, ymin, rxrang, yrang)
-
         obs = discard_infeasible(obs)
         if obs.shape[0] == 0:
             raise ValueError("not enough feasible observations")
 
-        X, M, S = windowed_moments(obs[:,1], obs[:,0])
-        self._mu = fit_cubic_constrained(X, M)
-        self._sigma = fit_cubic_constrained(X, S)
+        # Everything needed to update the fit incrementally: the
+        # first and last observations (which determine the window
+        # edges), and the running sums for each window.
+        xs = obs[:,1]
+        ys = obs[:,0]
+        self._first  = tuple(obs[0])
+        self._last   = tuple(obs[-1])
+        self._edges  = _window_edges(xs, 800)
+        self._shift  = ys.mean()
+        self._count, self._s1, self._s2 = \
+            _window_sums(xs, ys, self._edges, self._shift)
+        self._fit()
+
+    def _fit(self):
+        X, M, S = _window_moments(self._edges[2:-2], self._count,
+                                  self._s1, self._s2, self._shift)
+        self._mu = _fit_cubic_constrained(X, M)
+        self._sigma = _fit_cubic_constrained(X, S)
+
+    def update(self, obs):
+        """Incorporate additional observations OBS (laid out as for the
+           constructor) into this calibration, in time proportional to
+           the number of new observations, and refit the curves.
+
+           The window edges are determined by the first and last
+           observations in (distance, rtt) order.  If OBS would move
+           them, the result would not be the same as fitting all the
+           observations from scratch, so this calibration is left
+           unchanged and False is returned; the caller must refit.
+           False is also returned if this calibration was reconstructed
+           from its coefficients.  Otherwise returns True.
+        """
+        if not hasattr(self, '_count'):
+            return False
+        if obs.shape[0] == 0:
+            return True
+        obs = discard_infeasible(obs)
+        if obs.shape[0] == 0:
+            return True
+        if tuple(obs[0]) < self._first or tuple(obs[-1]) > self._last:
+            return False
+
+        _add_to_window_sums(obs[:,1], obs[:,0], self._edges, self._shift,
+                            self._count, self._s1, self._s2)
+        self._fit()
+        return True
+
+    @classmethod
+    def from_coefficients(cls, mu, sigma):
+        """Reconstruct a Spotter calibration from the parameters of
+           its mu and sigma curves (see CalibrationTable)."""
+        self = cls.__new__(cls)
+        self._mu = _ScaledCubic(*(float(x) for x in mu))
+        self._sigma = _ScaledCubic(*(float(x) for x in sigma))
+        return self
 
     def distance_range(self, rtts):
         med_rtt = np.percentile(rtts, .25)
         mu = self._mu(med_rtt)
         s5 = self._sigma(med_rtt) * 5
         return (max(mu - s5, 0), max(mu + s5, 0))
+
+# Magic number, current version, and conventional file name suffix of
+# the binary format for calibration tables.  See CalibrationTable.
+CALIBRATION_MAGIC   = b"AGEOCAL\0"
+CALIBRATION_VERSION = 1
+CALIBRATION_SUFFIX  = ".agc"
+
+def fit_models(obs):
+    """Fit CBG, QuasiOctant, and Spotter calibrations to OBS.  Returns a
+       3-tuple; a model that cannot be fit is replaced with None."""
+    fits = []
+    for model in (CBG, QuasiOctant, Spotter):
+        try:
+            cal = model(obs)
+        except (ValueError, RuntimeError):
+            cal = None
+        if isinstance(cal, CBG) and not hasattr(cal, '_curve'):
+            cal = None
+        fits.append(cal)
+    return tuple(fits)
+
+def update_models(models, obs, all_obs):
+    """Update MODELS, a (cbg, octant, spotter) tuple as returned by
+       fit_models, with additional observations OBS.  CBG and Spotter
+       are updated incrementally where possible (see their update
+       methods).  QuasiOctant cannot be, nor can a model that could
+       not be fit before; these are refit from ALL_OBS, a function
+       returning the complete set of observations.  Returns a new
+       3-tuple."""
+    cbg, octant, spotter = models
+    if (cbg is None or spotter is None or
+        not cbg.update(obs) or not spotter.update(obs)):
+        return fit_models(all_obs())
+    try:
+        octant = QuasiOctant(all_obs())
+    except (ValueError, RuntimeError):
+        octant = None
+    return cbg, octant, spotter
+
+class CalibrationTable:
+    """The CBG, QuasiOctant, and Spotter calibrations for a set of
+       landmarks, reduced to their coefficients and stored as parallel
+       arrays, one row per landmark.  Tables are normally created by
+       calibrate_all, and can be saved to and loaded from a binary
+       file (see ageo.binfile), which is memory-mapped when loaded.
+
+       Arrays:
+         ids            - landmark IDs (int64)
+         cbg            - CBG max curve, (m, b) per landmark
+         oct_max_ptr,
+         oct_max_pts    - QuasiOctant max curve: the vertices for landmark
+                          k are oct_max_pts[oct_max_ptr[k]:oct_max_ptr[k+1]]
+         oct_min_ptr,
+         oct_min_pts    - QuasiOctant min curve, likewise
+         spo_mu,
+         spo_sigma      - Spotter mu and sigma curves, 8 parameters each
+                          (see _ScaledCubic)
+
+       A calibration that could not be computed is recorded as NaN
+       coefficients, or an empty vertex list.
+    """
+
+    _ARRAYS = ("ids", "cbg", "oct_max_ptr", "oct_max_pts",
+               "oct_min_ptr", "oct_min_pts", "spo_mu", "spo_sigma")
+
+    def __init__(self, **arrays):
+        for name in self._ARRAYS:
+            setattr(self, name, arrays[name])
+        self._row = None
+
+    @classmethod
+    def from_models(cls, ids, models):
+        """Build a table from IDS and MODELS, a parallel list of
+           (cbg, octant, spotter) tuples as returned by fit_models."""
+        n = len(ids)
+        cbg       = np.full((n, 2), math.nan)
+        spo_mu    = np.full((n, 8), math.nan)
+        spo_sigma = np.full((n, 8), math.nan)
+        oct_max   = []
+        oct_min   = []
+        for k, (c, o, s) in enumerate(models):
+            if c is not None:
+                cbg[k] = c._curve['max']
+            if o is not None:
+                oct_max.append(o._curve['max']._points)
+                oct_min.append(o._curve['min']._points)
+            else:
+                oct_max.append(np.zeros((0, 2)))
+                oct_min.append(np.zeros((0, 2)))
+            if s is not None:
+                spo_mu[k] = s._mu
+                spo_sigma[k] = s._sigma
+
+        def ragged(parts):
+            ptr = np.zeros(n + 1, dtype=np.int64)
+            ptr[1:] = np.cumsum([p.shape[0] for p in parts])
+            pts = (np.concatenate(parts) if parts
+                   else np.zeros((0, 2)))
+            return ptr, pts
+
+        oct_max_ptr, oct_max_pts = ragged(oct_max)
+        oct_min_ptr, oct_min_pts = ragged(oct_min)
+        return cls(ids         = np.asarray(ids, dtype=np.int64),
+                   cbg         = cbg,
+                   oct_max_ptr = oct_max_ptr,
+                   oct_max_pts = oct_max_pts,
+                   oct_min_ptr = oct_min_ptr,
+                   oct_min_pts = oct_min_pts,
+                   spo_mu      = spo_mu,
+                   spo_sigma   = spo_sigma)
+
+    def __len__(self):
+        return self.ids.shape[0]
+
+    def row(self, id):
+        """The row index of landmark ID, or None if it is not present."""
+        if self._row is None:
+            self._row = { int(x): k for k, x in enumerate(self.ids) }
+        return self._row.get(int(id))
+
+    def make_cbg(self, k):
+        m, b = self.cbg[k]
+        if math.isnan(m) or math.isnan(b):
+            return None
+        return CBG.from_coefficients(float(m), float(b))
+
+    def make_octant(self, k):
+        max_pts = self.oct_max_pts[self.oct_max_ptr[k]:self.oct_max_ptr[k+1]]
+        min_pts = self.oct_min_pts[self.oct_min_ptr[k]:self.oct_min_ptr[k+1]]
+        if max_pts.shape[0] == 0 or min_pts.shape[0] == 0:
+            return None
+        return QuasiOctant.from_coefficients(max_pts, min_pts)
+
+    def make_spotter(self, k):
+        if np.isnan(self.spo_mu[k]).any() or np.isnan(self.spo_sigma[k]).any():
+            return None
+        return Spotter.from_coefficients(self.spo_mu[k], self.spo_sigma[k])
+
+    def as_dicts(self):
+        """Return a 3-tuple of dictionaries (cbg, octant, spotter),
+           mapping landmark IDs to calibration objects, in the same
+           form that the calibrate program used to pickle."""
+        dicts = ({}, {}, {})
+        for k, id in enumerate(self.ids):
+            for d, cal in zip(dicts, (self.make_cbg(k),
+                                      self.make_octant(k),
+                                      self.make_spotter(k))):
+                if cal is not None:
+                    d[int(id)] = cal
+        return dicts
+
+    def save(self, fname):
+        binfile.write_arrays(
+            fname, CALIBRATION_MAGIC, CALIBRATION_VERSION,
+            { "count": len(self) },
+            { name: getattr(self, name) for name in self._ARRAYS })
+
+    @classmethod
+    def load(cls, fname):
+        _, _, arrays = binfile.read_arrays(
+            fname, CALIBRATION_MAGIC, CALIBRATION_VERSION)
+        return cls(**arrays)
+
+def _group_by_destination(dst, src, dist, rtt, combined_id):
+    """Sort a columnar table of observations (see calibrate_all) by
+       destination.  Returns the observation matrix and a list of
+       (id, lo, hi) jobs, each referring to the slice obs[lo:hi]."""
+    dst  = np.asarray(dst)
+    src  = np.asarray(src)
+    keep = dst != src
+    dst  = dst[keep]
+    order = np.argsort(dst, kind='stable')
+    dst  = dst[order]
+    obs  = np.column_stack((np.asarray(dist, dtype=np.float64)[keep][order],
+                            np.asarray(rtt, dtype=np.float64)[keep][order]))
+
+    ids, starts = np.unique(dst, return_index=True)
+    ends = np.append(starts[1:], dst.shape[0])
+    jobs = list(zip(ids.tolist(), starts, ends))
+    if combined_id is not None and obs.shape[0]:
+        jobs.append((combined_id, 0, obs.shape[0]))
+    return obs, jobs
+
+# The work function of the current _run_jobs call.  Worker processes
+# are forked, so they inherit it, and the observation matrix it refers
+# to, instead of receiving them pickled.
+_job_work = None
+
+def _run_job(job):
+    return job[0], _job_work(job)
+
+def _run_jobs(jobs, work, processes, callback):
+    """Call WORK on each of JOBS, (id, lo, hi) tuples, in a pool of
+       PROCESSES forked worker processes.  Only the results are sent
+       back.  The largest jobs are started first.  Returns a dictionary
+       mapping each job's ID to its result."""
+    global _job_work
+    jobs = sorted(jobs, key=lambda job: job[2] - job[1], reverse=True)
+    results = {}
+    if processes == 1 or len(jobs) <= 1:
+        for job in jobs:
+            results[job[0]] = work(job)
+            if callback is not None:
+                callback(job[0])
+        return results
+
+    _job_work = work
+    try:
+        with multiprocessing.get_context('fork').Pool(processes) as pool:
+            for id, result in pool.imap_unordered(_run_job, jobs):
+                results[id] = result
+                if callback is not None:
+                    callback(id)
+    finally:
+        _job_work = None
+    return results
+
+def fit_all(dst, src, dist, rtt, *,
+            combined_id=0, processes=None, callback=None):
+    """Fit CBG, QuasiOctant, and Spotter calibrations for every
+       destination landmark at once.  The input is a columnar table of
+       observations: DST and SRC are vectors of landmark IDs, DIST the
+       true distance between them in meters, and RTT the observed
+       round-trip time in milliseconds.  Observations where DST == SRC
+       are ignored.
+
+       The observations are grouped by destination with one stable
+       sort, and each group is fitted in a pool of PROCESSES forked
+       worker processes, directly from a slice of the observation
+       matrix, which the workers inherit.  If COMBINED_ID is not
+       None, a calibration is also fitted to all of the observations
+       together and recorded under that ID.  If CALLBACK is not None,
+       it is called with each ID as its calibrations are completed.
+
+       Returns a dictionary mapping IDs to (cbg, octant, spotter)
+       tuples, as returned by fit_models.
+    """
+    obs, jobs = _group_by_destination(dst, src, dist, rtt, combined_id)
+    return _run_jobs(jobs, lambda job: fit_models(obs[job[1]:job[2]]),
+                     processes, callback)
+
+def update_all(models, dst, src, dist, rtt, all_obs, *,
+               combined_id=0, processes=None, callback=None):
+    """Update MODELS, a dictionary as returned by fit_all, with a
+       columnar table of additional observations (laid out as for
+       fit_all).  ALL_OBS(id) must return the complete set of
+       observations for destination ID (all destinations, for
+       COMBINED_ID), for models that must be refit from scratch; see
+       update_models.  Destinations without existing models are fit
+       from scratch.  Returns a new dictionary containing all the
+       models, updated or not.
+    """
+    obs, jobs = _group_by_destination(dst, src, dist, rtt, combined_id)
+
+    def work(job):
+        id, lo, hi = job
+        if id in models:
+            return update_models(models[id], obs[lo:hi],
+                                 lambda: all_obs(id))
+        return fit_models(all_obs(id))
+
+    updated = dict(models)
+    updated.update(_run_jobs(jobs, work, processes, callback))
+    return updated
+
+def calibrate_all(dst, src, dist, rtt, *,
+                  combined_id=0, processes=None, callback=None):
+    """Fit calibrations for every destination landmark at once, as
+       fit_all does, and return them as a CalibrationTable."""
+    models = fit_all(dst, src, dist, rtt, combined_id=combined_id,
+                     processes=processes, callback=callback)
+    ids = list(models.keys())
+    return CalibrationTable.from_models(ids, [models[id] for id in ids])
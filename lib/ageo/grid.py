@@ -0,0 +1,331 @@
+"""ageo.grid - active geolocation library: grid geometry.
+
+Every Location in a computation shares one longitude/latitude grid.
+Quantities that depend only on the grid -- the geocentric coordinates
+of each grid point, the area of each grid cell -- can therefore be
+computed once and reused for every probability matrix laid over that
+grid.  This module does that, and provides vectorized reductions over
+probability matrices that use the precomputed tables.
+"""
+
+import math
+import numpy as np
+import pyproj
+
+# WGS84 reference ellipsoid: see page 3-1 (physical page 34) of
+# http://earth-info.nga.mil/GandG/publications/tr8350.2/wgs84fin.pdf
+# A and F are exact, A is in meters.
+A  = 6378137         # equatorial semi-axis
+F  = 1/298.257223563 # flattening
+B  = A * (1-F)       # polar semi-axis
+E2 = F * (2-F)       # first eccentricity, squared
+E  = math.sqrt(E2)
+
+_WGS84geod = pyproj.Geod(ellps='WGS84')
+
+def _authalic_q(sinphi):
+    """The function q(phi) used by the equal-area projections of the
+       ellipsoid (Snyder, "Map Projections: A Working Manual", eq. 3-12).
+       The area of the band between two parallels is proportional to
+       the difference of their q values."""
+    esinphi = E * sinphi
+    return (1 - E2) * (sinphi / (1 - esinphi*esinphi)
+                       - np.log((1 - esinphi) / (1 + esinphi)) / (2*E))
+
+class GridGeometry:
+    """Per-grid precomputed geometry.  Grids are equally spaced in
+       both directions, so everything that varies with latitude is
+       stored once per latitude row, and everything that varies with
+       longitude is stored once per longitude column.
+
+       Properties:
+         cos_lon, sin_lon - cosine and sine of each grid longitude
+         row_r            - distance from the polar axis of each
+                            latitude row, in meters
+         row_z            - height above the equatorial plane of each
+                            latitude row, in meters
+         cell_area        - area of one grid cell in each latitude row,
+                            in square meters
+    """
+
+    def __init__(self, longitudes, latitudes):
+        lam = np.radians(np.asarray(longitudes, dtype=np.float64))
+        phi = np.radians(np.asarray(latitudes, dtype=np.float64))
+        self.cos_lon = np.cos(lam)
+        self.sin_lon = np.sin(lam)
+
+        # Geodetic to geocentric conversion at zero height; this is
+        # what PROJ.4's +proj=geocent does.
+        sinphi = np.sin(phi)
+        N = A / np.sqrt(1 - E2 * sinphi * sinphi)
+        self.row_r = N * np.cos(phi)
+        self.row_z = N * (1 - E2) * sinphi
+
+        # Each grid point is treated as a rectangle of parallels and
+        # meridians _centered_ on the point.  Its area depends only on
+        # its latitude and its breadth.  This is exactly the area of
+        # the corresponding rectangle in the cylindrical equal-area
+        # projection (lat_ts=0) formerly used by Location.area.
+        d_lon = abs(lam[1] - lam[0])
+        d_lat = (latitudes[1] - latitudes[0]) / 2
+        north = np.asarray(latitudes, dtype=np.float64) + d_lat
+        south = np.asarray(latitudes, dtype=np.float64) - d_lat
+        if not (np.all(-90 <= south) and np.all(north <= 90)):
+            raise AssertionError("expected -90 <= {} < {} <= 90"
+                                 .format(south.min(), north.max()))
+        self.cell_area = (A * A * d_lon / 2 *
+                          (_authalic_q(np.sin(np.radians(north))) -
+                           _authalic_q(np.sin(np.radians(south)))))
+
+_geometry_cache = {}
+def grid_geometry(longitudes, latitudes):
+    """Return the GridGeometry for the grid defined by LONGITUDES and
+       LATITUDES, computing it if necessary.  Grids are equally spaced,
+       so they are identified by their endpoints and sizes."""
+    key = (len(longitudes), float(longitudes[0]), float(longitudes[-1]),
+           len(latitudes),  float(latitudes[0]),  float(latitudes[-1]))
+    geom = _geometry_cache.get(key)
+    if geom is None:
+        geom = GridGeometry(longitudes, latitudes)
+        _geometry_cache[key] = geom
+    return geom
+
+def csr_row_indices(matrix):
+    """Reconstruct the row index of every stored entry of the CSR
+       matrix MATRIX.  (The column indices are just matrix.indices.)"""
+    return np.repeat(np.arange(matrix.shape[0], dtype=matrix.indices.dtype),
+                     np.diff(matrix.indptr))
+
+def moments(matrix, geom):
+    """Compute the weighted moments of the probability matrix MATRIX,
+       laid over the grid described by GridGeometry GEOM.  Rows of
+       MATRIX correspond to longitudes and columns to latitudes.
+
+       Returns a tuple (total, covariance, area):
+         total      - weighted sum of the geocentric coordinates of all
+                      nonzero cells (since the matrix is normalized,
+                      this is their mean)
+         covariance - covariance matrix of the weighted geocentric
+                      coordinates, as np.cov would compute it
+         area       - weighted area of the nonzero cells, in square
+                      meters; see Location.area for the weighting
+    """
+    I = csr_row_indices(matrix)
+    J = matrix.indices
+    V = matrix.data.astype(np.float64)
+    n = V.shape[0]
+
+    rv = geom.row_r[J] * V
+    P = np.vstack((rv * geom.cos_lon[I],
+                   rv * geom.sin_lon[I],
+                   geom.row_z[J] * V))
+    rv = None
+
+    total = P.sum(axis=1)
+    if n > 1:
+        dev = P - (total / n)[:, np.newaxis]
+        covariance = dev.dot(dev.T) / (n - 1)
+    else:
+        covariance = np.full((3, 3), math.nan)
+
+    S = V.sum()
+    if S == 0:
+        area = 0
+    else:
+        # Adjust from 1-overall to 1-per-cell normalization.
+        area = n * V.dot(geom.cell_area[J]) / S
+
+    return total, covariance, area
+
+class CellIndex:
+    """Index over the nonzero cells of a probability matrix, for
+       nearest-cell queries.
+
+       Cells are grouped by latitude row and sorted by longitude
+       within each row.  Along any one parallel, geodesic distance
+       from a fixed point grows monotonically with the difference in
+       longitude, so the nearest cell within each row must be one of
+       the two cells bracketing the query longitude (or, if the grid
+       wraps around the antimeridian, one of the row's endpoints).
+       A query therefore costs one binary search and at most four
+       geodesic distance computations per occupied row, rather than
+       one distance computation per nonzero cell.
+
+       If SELECT is not None, it is a boolean vector parallel to
+       MATRIX.data, and only the selected cells are indexed.
+    """
+
+    def __init__(self, matrix, longitudes, latitudes, select=None):
+        self.longitudes = longitudes
+        self.latitudes  = latitudes
+        n_lon = len(longitudes)
+        self.n_lon = n_lon
+
+        keep = matrix.data > 0
+        if select is not None:
+            keep &= select
+        keys = (matrix.indices[keep].astype(np.int64) * n_lon
+                + csr_row_indices(matrix)[keep])
+        keys.sort()
+        self.keys = keys
+
+        rows = np.unique(keys // n_lon)
+        self.row_base  = rows * n_lon
+        self.row_first = np.searchsorted(keys, self.row_base)
+        self.row_last  = np.searchsorted(keys, self.row_base + n_lon) - 1
+
+        spacing = abs(longitudes[1] - longitudes[0])
+        self.wraps = (abs(longitudes[-1] - longitudes[0]) + spacing
+                      >= 360 - spacing/2)
+
+    def __len__(self):
+        return self.keys.shape[0]
+
+    def nearest(self, lon, lat):
+        """Find the indexed cell nearest to (LON, LAT).  Returns a tuple
+           (distance, i, j), where I and J are the grid indices of the
+           cell and DISTANCE is the geodesic distance to its center in
+           meters.  If the index is empty, returns (inf, None, None).
+        """
+        if not len(self):
+            return math.inf, None, None
+
+        q = np.searchsorted(self.longitudes, lon)
+        succ = np.searchsorted(self.keys, self.row_base + q)
+        pred = succ - 1
+        first = self.row_first
+        last  = self.row_last
+        cand = [np.clip(succ, first, last), np.clip(pred, first, last)]
+        if self.wraps:
+            cand.extend((first, last))
+        cand = self.keys[np.unique(np.concatenate(cand))]
+
+        ci = cand % self.n_lon
+        cj = cand // self.n_lon
+        _, _, dist = _WGS84geod.inv(*np.broadcast_arrays(
+            lon, lat, self.longitudes[ci], self.latitudes[cj]))
+        k = np.argmin(dist)
+        return dist[k], ci[k], cj[k]
+
+class OccupancyPyramid:
+    """Multi-resolution summary of which cells of a probability matrix
+       are nonzero.  Level 0 is a boolean matrix with the same shape
+       as MATRIX, true wherever MATRIX is positive.  Each subsequent
+       level halves the resolution in both directions: cell (i, j) of
+       level k is true if any of the cells (2i..2i+1, 2j..2j+1) of
+       level k-1 is true.  Thus cell (i, j) of level k summarizes the
+       block of full-resolution cells (i*2^k .. (i+1)*2^k - 1,
+       j*2^k .. (j+1)*2^k - 1).
+    """
+
+    def __init__(self, matrix):
+        pos = matrix.data > 0
+        occ = np.zeros(matrix.shape, dtype=bool)
+        occ[csr_row_indices(matrix)[pos], matrix.indices[pos]] = True
+        self.levels = [occ]
+        while max(occ.shape) > 1:
+            ni, nj = occ.shape
+            padded = np.zeros((ni + (ni & 1), nj + (nj & 1)), dtype=bool)
+            padded[:ni, :nj] = occ
+            occ = (padded.reshape(padded.shape[0]//2, 2,
+                                  padded.shape[1]//2, 2)
+                   .any(axis=3).any(axis=1))
+            self.levels.append(occ)
+
+    @classmethod
+    def from_levels(cls, levels):
+        """Reconstitute a pyramid from its list of LEVELS, e.g. as
+           saved by ageo.Map.share."""
+        self = cls.__new__(cls)
+        self.levels = list(levels)
+        return self
+
+    def __len__(self):
+        return len(self.levels)
+
+def refine_cells(longitudes, latitudes, extent, may_be_nonzero, *,
+                 pyramid=None, slack=1.01):
+    """Coarse-to-fine search for the grid cells within EXTENT that might
+       have nonzero probability.  EXTENT is a tuple (min_i, max_i,
+       min_j, max_j) of grid indices, with the maxima exclusive, as
+       computed by ageo.mask_range.
+
+       The search starts with large square blocks of cells, aligned
+       to multiples of a power of two, and works down to individual
+       cells.  At each level, each block is summarized by the center
+       of its bounding rectangle and a radius: the largest geodesic
+       distance from that center to any cell in the block, which on
+       the sphere is always the distance to one of the corners, and
+       is padded by SLACK to allow for the flattening.  The function
+       MAY_BE_NONZERO(lon, lat, radius) is called with vectors of
+       block centers and radii, and must return a boolean vector
+       which is false only for blocks where _no_ cell within RADIUS
+       of the center can have nonzero probability.  Surviving blocks
+       are split into four and examined at the next level.
+
+       If PYRAMID (an OccupancyPyramid) is not None, blocks that are
+       empty at the corresponding level of the pyramid are discarded
+       without calling MAY_BE_NONZERO.
+
+       Returns vectors I, J of the grid indices of the cells that
+       survive to the finest level.  Callers must still evaluate
+       those cells individually; some of them may turn out to be zero.
+    """
+    min_i, max_i, min_j, max_j = extent
+    if max_i <= min_i or max_j <= min_j:
+        empty = np.zeros(0, dtype=np.intp)
+        return empty, empty
+
+    # Start at a level with a few blocks along the longer axis, but
+    # keep blocks under 90 degrees of longitude across, which
+    # guarantees that the corner of a block is its farthest point from
+    # its center.
+    span = max(max_i - min_i, max_j - min_j)
+    level = max(0, span.bit_length() - 4)
+    lon_step = abs(longitudes[1] - longitudes[0])
+    while level > 0 and (1 << level) * lon_step >= 90:
+        level -= 1
+    if pyramid is not None:
+        level = min(level, len(pyramid) - 1)
+
+    def block_range(lo, hi, k):
+        return np.arange(lo >> k, ((hi - 1) >> k) + 1, dtype=np.intp)
+
+    bi = block_range(min_i, max_i, level)
+    bj = block_range(min_j, max_j, level)
+    BI = np.tile(bi, len(bj))
+    BJ = np.repeat(bj, len(bi))
+
+    while True:
+        if pyramid is not None:
+            keep = pyramid.levels[level][BI, BJ]
+            BI = BI[keep]
+            BJ = BJ[keep]
+        if level == 0 or not len(BI):
+            return BI, BJ
+
+        ia = np.maximum(BI << level, min_i)
+        ib = np.minimum(((BI + 1) << level) - 1, max_i - 1)
+        ja = np.maximum(BJ << level, min_j)
+        jb = np.minimum(((BJ + 1) << level) - 1, max_j - 1)
+        clon = (longitudes[ia] + longitudes[ib]) / 2
+        clat = (latitudes[ja] + latitudes[jb]) / 2
+        n = len(BI)
+        _, _, corner = _WGS84geod.inv(
+            np.tile(clon, 4), np.tile(clat, 4),
+            longitudes[np.concatenate((ia, ia, ib, ib))],
+            latitudes[np.concatenate((ja, jb, ja, jb))])
+        radius = corner.reshape(4, n).max(axis=0) * slack
+
+        keep = np.asarray(may_be_nonzero(clon, clat, radius), dtype=bool)
+        BI = BI[keep]
+        BJ = BJ[keep]
+
+        # Split each surviving block into (up to) four.
+        level -= 1
+        BI = (BI[:, np.newaxis] * 2 + np.array([0, 1, 0, 1])).ravel()
+        BJ = (BJ[:, np.newaxis] * 2 + np.array([0, 0, 1, 1])).ravel()
+        keep = ((BI >= min_i >> level) & (BI <= (max_i - 1) >> level) &
+                (BJ >= min_j >> level) & (BJ <= (max_j - 1) >> level))
+        BI = BI[keep]
+        BJ = BJ[keep]
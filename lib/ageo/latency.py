@@ -0,0 +1,168 @@
+"""ageo.latency - active geolocation library: latency-vector index.
+
+A latency vector records, for one target host, the minimum RTT to
+each of a fixed list of landmarks, with gaps where there was no
+measurement.  Hosts that are close together tend to have similar
+latency vectors, so the known-position hosts whose vectors are most
+similar to a new host's give a quick estimate of where it is, before
+any ranging functions are evaluated.
+
+Vectors are compared on log RTT, so that each difference is relative
+to the size of the RTTs involved, by the mean absolute difference over
+the landmarks present in both vectors (masked L1).  A constant factor
+C of slowdown along the whole path adds |log C| to the distance; it is
+deliberately not normalized away, because the overall RTT level is
+itself evidence of how far a host is from the landmarks.  Pairs with
+fewer than MIN_COMMON landmarks in common are treated as infinitely
+far apart.
+
+An index is saved in the ageo.binfile format.
+"""
+
+import concurrent.futures
+
+import numpy as np
+
+from . import binfile
+
+LATENCY_MAGIC   = b"AGEOLAT\0"
+LATENCY_VERSION = 1
+LATENCY_SUFFIX  = ".agv"
+
+# Fewest landmarks two vectors must have in common to be compared.
+MIN_COMMON = 3
+
+# Queries, and the indexed vectors they are compared with, are
+# processed in blocks sized so that each temporary
+# (queries x vectors x landmarks) array has about this many elements.
+BLOCK_ELEMENTS = 1 << 22
+
+def log_rtts(rtts):
+    """Convert RTTs in milliseconds, with NaN (or anything not positive)
+       for missing values, to the float32 log RTTs used by the index."""
+    rtts = np.asarray(rtts, dtype=np.float64)
+    with np.errstate(invalid='ignore', divide='ignore'):
+        return np.where(rtts > 0, np.log(rtts), np.nan).astype(np.float32)
+
+class LatencyIndex:
+    """Index over the latency vectors of a set of hosts with known
+       positions.
+
+       Properties:
+         landmarks - list of landmark labels, one per vector component
+         names     - vector of host names, one per indexed vector
+         lons      - vector of host longitudes
+         lats      - vector of host latitudes
+         values    - matrix of log RTTs, one row per host, NaN where
+                     missing
+    """
+
+    def __init__(self, landmarks, names, lons, lats, values):
+        self.landmarks = list(landmarks)
+        self.names = np.asarray(names)
+        self.lons = np.asarray(lons, dtype=np.float64)
+        self.lats = np.asarray(lats, dtype=np.float64)
+        self.values = values
+        if values.shape != (len(self.names), len(self.landmarks)):
+            raise ValueError("latency matrix shape {!r} is inconsistent "
+                             "with {} hosts and {} landmarks"
+                             .format(values.shape, len(self.names),
+                                     len(self.landmarks)))
+
+        self._present = ~np.isnan(values)
+        self._filled = np.where(self._present, values, 0).astype(np.float32)
+
+    @classmethod
+    def build(cls, landmarks, names, lons, lats, rtts):
+        """Construct an index from a matrix RTTS of minimum RTTs in
+           milliseconds (see log_rtts), one row per host."""
+        return cls(landmarks, names, lons, lats, log_rtts(rtts))
+
+    def __len__(self):
+        return len(self.names)
+
+    def distances(self, rtts, *, min_common=MIN_COMMON):
+        """Masked L1 distance from each of the vectors RTTS (a matrix
+           of RTTs in milliseconds, one row per query, with columns in
+           the order of self.landmarks) to each indexed vector.
+           Returns a (queries x indexed vectors) matrix."""
+        q = log_rtts(np.atleast_2d(rtts))
+        if q.shape[1] != len(self.landmarks):
+            raise ValueError("query vectors have {} components, expected {}"
+                             .format(q.shape[1], len(self.landmarks)))
+        qp = ~np.isnan(q)
+        qf = np.where(qp, q, 0).astype(np.float32)
+
+        # Only the landmarks present in at least one of the queries
+        # can contribute to the distances.
+        cols = np.nonzero(qp.any(axis=0))[0]
+        qf = qf[:, np.newaxis, cols]
+        qp = qp[:, np.newaxis, cols]
+
+        n = len(self)
+        total = np.empty((q.shape[0], n), dtype=np.float64)
+        common = np.empty((q.shape[0], n), dtype=np.intp)
+        rows = max(1, BLOCK_ELEMENTS // max(1, q.shape[0] * len(cols)))
+        for lo in range(0, n, rows):
+            hi = min(n, lo + rows)
+            xf = self._filled[lo:hi][:, cols]
+            both = qp & self._present[lo:hi][:, cols]
+            total[:, lo:hi] = np.where(both, np.abs(qf - xf), 0) \
+                                .sum(axis=2, dtype=np.float64)
+            common[:, lo:hi] = both.sum(axis=2)
+
+        with np.errstate(invalid='ignore', divide='ignore'):
+            return np.where(common >= max(min_common, 1),
+                            total / common, np.inf)
+
+    def query(self, rtts, k=10, *, min_common=MIN_COMMON, threads=None):
+        """Find the K indexed vectors nearest to each of the vectors
+           RTTS (see distances).  Returns two (queries x K) matrices:
+           the indices of the neighbors, nearest first, and their
+           distances.  Where there are fewer than K comparable
+           vectors, the remaining entries are -1 and infinity.
+           Blocks of queries are processed in parallel."""
+        rtts = np.atleast_2d(np.asarray(rtts, dtype=np.float64))
+        n_q = rtts.shape[0]
+        n = len(self)
+        k = min(k, n)
+        nbrs = np.full((n_q, k), -1, dtype=np.intp)
+        dists = np.full((n_q, k), np.inf)
+        if n_q == 0 or k == 0:
+            return nbrs, dists
+
+        block = max(1, BLOCK_ELEMENTS // max(1, n * len(self.landmarks)))
+
+        def do_block(lo):
+            hi = min(n_q, lo + block)
+            d = self.distances(rtts[lo:hi], min_common=min_common)
+            if k < n:
+                part = np.argpartition(d, k - 1, axis=1)[:, :k]
+            else:
+                part = np.broadcast_to(np.arange(n), d.shape)
+            pd = np.take_along_axis(d, part, axis=1)
+            order = np.argsort(pd, axis=1, kind='stable')
+            part = np.take_along_axis(part, order, axis=1)
+            pd = np.take_along_axis(pd, order, axis=1)
+            nbrs[lo:hi] = np.where(np.isfinite(pd), part, -1)
+            dists[lo:hi] = pd
+
+        with concurrent.futures.ThreadPoolExecutor(threads) as pool:
+            for _ in pool.map(do_block, range(0, n_q, block)):
+                pass
+
+        return nbrs, dists
+
+    def save(self, fname):
+        binfile.write_arrays(fname, LATENCY_MAGIC, LATENCY_VERSION,
+                             { "landmarks": self.landmarks },
+                             { "names": self.names.astype(str),
+                               "lons": self.lons, "lats": self.lats,
+                               "values": self.values })
+
+    @classmethod
+    def load(cls, fname):
+        _, meta, arrays = binfile.read_arrays(fname, LATENCY_MAGIC,
+                                              LATENCY_VERSION)
+        return cls(meta["landmarks"], arrays["names"], arrays["lons"],
+                   arrays["lats"], arrays["values"])
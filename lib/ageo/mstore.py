@@ -0,0 +1,473 @@
+"""ageo.mstore - active geolocation library: measurement store.
+
+A measurement store holds round-trip time measurements, one row per
+ping, in four fixed-width columns:
+
+    src    int32    source landmark id
+    dst    int32    destination landmark id
+    day    int32    days since 1970-01-01 (UTC) when the row was ingested
+    rtt    float32  round-trip time, milliseconds
+
+The store is a directory of segment files in the ageo.binfile format.
+Segments are never modified once written; new measurements go into a
+new segment.  Within a segment, rows are sorted by destination, and
+the arrays "dst_ids" and "dst_offsets" index them, in the same way as
+the indptr array of a CSR matrix: the rows for dst_ids[k] are
+dst_offsets[k] through dst_offsets[k+1]-1.  Since segments are
+memory-mapped, the per-destination columns are views of the file,
+not copies.
+
+Each segment's metadata records, for each CSV file it was loaded
+from, the byte range that was consumed.  CSV files that grow by
+appending (as the files written by retrieve-calibration-data-ripe
+do) can therefore be brought up to date by reading only their new
+tails.
+
+A fixed-size sample of each segment's rows can be drawn with
+Segment.sample.  Since segments never change, neither do their
+samples, which are cached in files next to the segments.
+
+The true distances between landmarks are kept next to the store, in
+a DistanceMatrix; see that class for details.
+"""
+
+import concurrent.futures
+import glob
+import io
+import os
+import time
+
+import numpy as np
+import pyproj
+
+from . import binfile
+
+SEGMENT_MAGIC   = b"AGEOMST\0"
+SEGMENT_VERSION = 1
+SEGMENT_SUFFIX  = ".ams"
+
+SAMPLE_MAGIC   = b"AGEOSMP\0"
+SAMPLE_VERSION = 1
+SAMPLE_SUFFIX  = ".smp"
+
+DISTANCE_MAGIC   = b"AGEODST\0"
+DISTANCE_VERSION = 1
+DISTANCE_SUFFIX  = ".agd"
+
+CSV_FIELDS = ("d.id", "s.id", "k", "rtt")
+
+# RTTs outside this range are measurement errors.
+RTT_MIN = 0
+RTT_MAX = 4000
+
+class StaleStoreError(RuntimeError):
+    """Raised when a CSV file already loaded into a store has been
+       changed other than by appending to it."""
+    pass
+
+class Segment:
+    """One immutable segment of a MeasurementStore."""
+
+    def __init__(self, fname):
+        self.fname = fname
+        self.name = os.path.basename(fname)
+        _, meta, arrays = binfile.read_arrays(fname, SEGMENT_MAGIC,
+                                              SEGMENT_VERSION)
+        self.sources = { f: tuple(v) for f, v in meta["sources"].items() }
+        self.src = arrays["src"]
+        self.dst = arrays["dst"]
+        self.day = arrays["day"]
+        self.rtt = arrays["rtt"]
+        self.dst_ids = arrays["dst_ids"]
+        self.dst_offsets = arrays["dst_offsets"]
+
+    def __len__(self):
+        return self.rtt.shape[0]
+
+    def rows_for(self, dst):
+        """The (src, day, rtt) columns for destination DST, as views
+           into the segment.  Returns None if there are none."""
+        k = np.searchsorted(self.dst_ids, dst)
+        if k == len(self.dst_ids) or self.dst_ids[k] != dst:
+            return None
+        lo, hi = self.dst_offsets[k], self.dst_offsets[k+1]
+        return self.src[lo:hi], self.day[lo:hi], self.rtt[lo:hi]
+
+    def sample_fname(self, per_pair):
+        return "{}-{}{}".format(self.fname[:-len(SEGMENT_SUFFIX)],
+                                per_pair, SAMPLE_SUFFIX)
+
+    def sample(self, per_pair):
+        """Draw up to PER_PAIR rows for each (src, dst) pair in this
+           segment, always including the ones with the smallest and
+           largest RTT.  The draw depends only on the contents of the
+           segment.  Returns (src, dst, rtt) columns, sorted by dst,
+           then src, then rtt.  The sample is cached in a file next to
+           the segment.
+        """
+        sfname = self.sample_fname(per_pair)
+        try:
+            _, _, arrays = binfile.read_arrays(sfname, SAMPLE_MAGIC,
+                                               SAMPLE_VERSION)
+            return arrays["src"], arrays["dst"], arrays["rtt"]
+        except (OSError, ValueError):
+            pass
+
+        order = np.lexsort((self.rtt, self.src, self.dst))
+        src = self.src[order]
+        dst = self.dst[order]
+        rtt = self.rtt[order]
+        n = len(order)
+        keep = np.ones(n, dtype=bool)
+        if n:
+            new = np.ones(n, dtype=bool)
+            new[1:] = (src[1:] != src[:-1]) | (dst[1:] != dst[:-1])
+            group = np.cumsum(new) - 1
+            starts = np.flatnonzero(new)
+            sizes = np.diff(np.append(starts, n))
+            pos = np.arange(n) - starts[group]
+
+            # In pairs with too many rows, keep the first and last,
+            # and the PER_PAIR-2 rows between them with the smallest
+            # random keys.
+            big = sizes[group] > per_pair
+            inner = np.flatnonzero(big & (pos > 0)
+                                   & (pos < sizes[group] - 1))
+            key = np.random.RandomState(0).random_sample(len(inner))
+            inner = inner[np.lexsort((key, group[inner]))]
+            istarts = np.flatnonzero(np.append(
+                True, group[inner][1:] != group[inner][:-1]))
+            ipos = (np.arange(len(inner))
+                    - np.repeat(istarts, np.diff(np.append(istarts,
+                                                           len(inner)))))
+            keep[big] = (pos[big] == 0) | (pos[big] == sizes[group][big] - 1)
+            keep[inner[ipos < per_pair - 2]] = True
+
+        src, dst, rtt = src[keep], dst[keep], rtt[keep]
+        binfile.write_arrays(sfname, SAMPLE_MAGIC, SAMPLE_VERSION,
+                             { "segment": self.name, "per_pair": per_pair },
+                             { "src": src, "dst": dst, "rtt": rtt })
+        return src, dst, rtt
+
+    @staticmethod
+    def write(fname, src, dst, day, rtt, sources):
+        """Write a new segment holding the given columns to FNAME.
+           SOURCES maps CSV file names to the (start, end, mtime) of
+           the part of each that the rows came from."""
+        order = np.argsort(dst, kind="stable")
+        src = np.asarray(src, dtype=np.int32)[order]
+        dst = np.asarray(dst, dtype=np.int32)[order]
+        day = np.asarray(day, dtype=np.int32)[order]
+        rtt = np.asarray(rtt, dtype=np.float32)[order]
+        dst_ids, starts = np.unique(dst, return_index=True)
+        dst_offsets = np.append(starts, len(dst)).astype(np.int64)
+
+        binfile.write_arrays(
+            fname, SEGMENT_MAGIC, SEGMENT_VERSION,
+            { "sources": { f: list(v) for f, v in sources.items() } },
+            { "src": src, "dst": dst, "day": day, "rtt": rtt,
+              "dst_ids": dst_ids.astype(np.int32),
+              "dst_offsets": dst_offsets })
+
+def read_csv_tail(fname, start):
+    """Read the measurement rows of FNAME from byte offset START up to
+       the last complete line.  Returns (d_id, s_id, rtt, end), where
+       END is the offset just past the last line read."""
+    with open(fname, "rb") as fp:
+        fp.seek(start)
+        data = fp.read()
+    end = data.rfind(b"\n") + 1
+    data = data[:end]
+    if start == 0 and end > 0:
+        header, _, data = data.partition(b"\n")
+        fields = tuple(f.strip().decode("utf-8")
+                       for f in header.split(b","))
+        if fields != CSV_FIELDS:
+            raise RuntimeError("{}: expected columns {}, got {}"
+                               .format(fname, ",".join(CSV_FIELDS),
+                                       ",".join(fields)))
+    if not data.strip():
+        empty = np.zeros(0)
+        return empty.astype(np.int32), empty.astype(np.int32), empty, \
+            start + end
+
+    rows = np.loadtxt(io.BytesIO(data), delimiter=",", usecols=(0, 1, 3),
+                      ndmin=2)
+    return (rows[:,0].astype(np.int32), rows[:,1].astype(np.int32),
+            rows[:,2], start + end)
+
+class MeasurementStore:
+    """A directory of measurement segments; see the module docstring."""
+
+    def __init__(self, dirname):
+        self.dirname = dirname
+        os.makedirs(dirname, exist_ok=True)
+        self.segments = [
+            Segment(f) for f in
+            sorted(glob.glob(os.path.join(dirname, "*" + SEGMENT_SUFFIX)))
+        ]
+
+    def __len__(self):
+        return sum(len(seg) for seg in self.segments)
+
+    def consumed(self):
+        """A dictionary mapping each CSV file that has been loaded into
+           the store to (end, mtime) for the last part of it loaded."""
+        rv = {}
+        for seg in self.segments:
+            for f, (start, end, mtime) in seg.sources.items():
+                if f not in rv or rv[f][0] < end:
+                    rv[f] = (end, mtime)
+        return rv
+
+    def clear(self):
+        """Delete all segments, and their cached samples."""
+        for seg in self.segments:
+            os.remove(seg.fname)
+        for f in glob.glob(os.path.join(self.dirname, "*" + SAMPLE_SUFFIX)):
+            os.remove(f)
+        self.segments = []
+
+    def append_csv(self, fnames, *, callback=None):
+        """Load whatever has been added to the CSV files FNAMES since
+           they were last loaded, and write it as a new segment.
+           Returns the new Segment, or None if there was nothing new.
+           Raises StaleStoreError if any of the files has shrunk.
+           CALLBACK, if not None, is called with each file name that
+           has new data, before reading it.
+        """
+        consumed = self.consumed()
+        cols = []
+        sources = {}
+        for fname in fnames:
+            st = os.stat(fname)
+            start, _ = consumed.get(fname, (0, 0))
+            if st.st_size < start:
+                raise StaleStoreError(
+                    "{}: file has shrunk since it was loaded".format(fname))
+            if st.st_size == start:
+                continue
+            if callback is not None:
+                callback(fname)
+            d_id, s_id, rtt, end = read_csv_tail(fname, start)
+            if end == start:
+                continue
+            sources[fname] = (start, end, st.st_mtime)
+            cols.append((d_id, s_id,
+                         np.full(len(rtt), int(st.st_mtime // 86400),
+                                 dtype=np.int32),
+                         rtt))
+
+        if not sources:
+            return None
+
+        dst, src, day, rtt = (np.concatenate(c) for c in zip(*cols))
+        keep = (rtt >= RTT_MIN) & (rtt < RTT_MAX)
+        # Segment names sort in order of creation.
+        fname = os.path.join(self.dirname,
+                             "{:020d}{}".format(int(time.time() * 1e6),
+                                                SEGMENT_SUFFIX))
+        Segment.write(fname, src[keep], dst[keep], day[keep], rtt[keep],
+                      sources)
+        seg = Segment(fname)
+        self.segments.append(seg)
+        return seg
+
+    def destinations(self):
+        """All destination ids with at least one row, sorted."""
+        if not self.segments:
+            return np.zeros(0, dtype=np.int32)
+        return np.unique(np.concatenate([seg.dst_ids
+                                         for seg in self.segments]))
+
+    def rows_for(self, dst, segments=None):
+        """The (src, day, rtt) columns for destination DST, over all
+           segments, or just SEGMENTS if not None.  When only one
+           segment has rows for DST, these are views into it."""
+        parts = [p for p in ((seg.rows_for(dst)
+                              for seg in (self.segments if segments is None
+                                          else segments)))
+                 if p is not None]
+        if not parts:
+            return (np.zeros(0, dtype=np.int32), np.zeros(0, dtype=np.int32),
+                    np.zeros(0, dtype=np.float32))
+        if len(parts) == 1:
+            return parts[0]
+        return tuple(np.concatenate(c) for c in zip(*parts))
+
+    def sample(self, per_pair, segments=None):
+        """The (src, dst, rtt) columns of the samples (see
+           Segment.sample) of all segments, or just SEGMENTS if not
+           None.  Only segments without a cached sample are read."""
+        segments = self.segments if segments is None else segments
+        parts = [seg.sample(per_pair) for seg in segments]
+        if not parts:
+            z = np.zeros(0, dtype=np.int32)
+            return z, z, np.zeros(0, dtype=np.float32)
+        return tuple(np.concatenate(c) for c in zip(*parts))
+
+    def columns(self, segments=None):
+        """The (src, dst, day, rtt) columns of all segments, or just
+           SEGMENTS if not None."""
+        segments = self.segments if segments is None else segments
+        if not segments:
+            z = np.zeros(0, dtype=np.int32)
+            return z, z, z, np.zeros(0, dtype=np.float32)
+        if len(segments) == 1:
+            seg = segments[0]
+            return seg.src, seg.dst, seg.day, seg.rtt
+        return tuple(np.concatenate([getattr(seg, c) for seg in segments])
+                     for c in ("src", "dst", "day", "rtt"))
+
+
+_WGS84inv = pyproj.Geod(ellps="WGS84").inv
+
+def _packed_index(i, j, n):
+    """Index of element (I, J), I < J, of an N-by-N strictly upper
+       triangular matrix stored row by row."""
+    return i*n - i*(i+1)//2 + (j - i - 1)
+
+class _DistanceRow:
+    __slots__ = ("_matrix", "_i")
+    def __init__(self, matrix, i):
+        self._matrix = matrix
+        self._i = i
+    def __getitem__(self, sid):
+        return self._matrix.distance_ij(self._i, self._matrix.index[sid])
+
+class DistanceMatrix:
+    """The WGS84 geodesic distances, in meters, between all pairs of a
+       set of landmarks.
+
+       Only the strictly upper triangle of the (symmetric, zero-diagonal)
+       matrix is stored, packed row by row as float32, which is more
+       than precise enough for calibration: the error is at most a few
+       meters at antipodal distances.  Landmarks are ordered by id.
+
+       distances[dst][src] gives a single distance, as with the nested
+       dictionaries this replaces; lookup() does the same for whole
+       arrays of ids at once.
+    """
+
+    def __init__(self, ids, lons, lats, packed):
+        self.ids = np.asarray(ids, dtype=np.int64)
+        self.lons = np.asarray(lons, dtype=np.float64)
+        self.lats = np.asarray(lats, dtype=np.float64)
+        self.packed = packed
+        self.index = { int(id): i for i, id in enumerate(self.ids) }
+
+    def __len__(self):
+        return len(self.ids)
+
+    def __contains__(self, id):
+        return id in self.index
+
+    def __getitem__(self, did):
+        return _DistanceRow(self, self.index[did])
+
+    def distance_ij(self, i, j):
+        if i == j:
+            return 0.0
+        if i > j:
+            i, j = j, i
+        return float(self.packed[_packed_index(i, j, len(self.ids))])
+
+    def _indices(self, ids):
+        """Positions in self.ids of each of IDS; raises KeyError for the
+           first id that is not in the matrix."""
+        ids = np.asarray(ids, dtype=np.int64)
+        i = np.searchsorted(self.ids, ids)
+        known = i < len(self.ids)
+        known[known] = self.ids[i[known]] == ids[known]
+        if not known.all():
+            raise KeyError(int(ids[~known].flat[0]))
+        return i
+
+    def lookup(self, dst, src):
+        """Distances from each of the landmarks SRC to the corresponding
+           landmark in DST (arrays of ids of the same shape).  Raises
+           KeyError if any of the ids is not in the matrix."""
+        i = self._indices(dst)
+        j = self._indices(src)
+        lo = np.minimum(i, j)
+        hi = np.maximum(i, j)
+        same = lo == hi
+        k = _packed_index(lo, np.where(same, lo + 1, hi), len(self.ids))
+        k[same] = 0
+        rv = self.packed[k].astype(np.float64) if len(self.packed) \
+             else np.zeros(k.shape)
+        rv[same] = 0
+        return rv
+
+    @classmethod
+    def compute(cls, positions, *, previous=None, threads=None):
+        """Compute the distance matrix for POSITIONS, a dictionary
+           mapping landmark ids to objects with .lon and .lat attributes.
+           If PREVIOUS is a DistanceMatrix, distances between pairs of
+           landmarks that have not moved are copied from it, and only
+           the rows and columns for new and moved landmarks are
+           computed.  Computation is split over THREADS threads.
+        """
+        ids = np.array(sorted(positions.keys()), dtype=np.int64)
+        lons = np.array([positions[id].lon for id in ids], dtype=np.float64)
+        lats = np.array([positions[id].lat for id in ids], dtype=np.float64)
+        n = len(ids)
+        packed = np.zeros(n*(n-1)//2, dtype=np.float32)
+
+        # Map each landmark to its row in PREVIOUS, if it is there
+        # with the same coordinates.
+        old = np.full(n, -1, dtype=np.int64)
+        if previous is not None and len(previous):
+            k = np.minimum(np.searchsorted(previous.ids, ids),
+                           len(previous.ids) - 1)
+            same = ((previous.ids[k] == ids) &
+                    (previous.lons[k] == lons) & (previous.lats[k] == lats))
+            old[same] = k[same]
+
+        def do_row(i):
+            j = np.arange(i+1, n)
+            if not len(j):
+                return
+            dst = slice(_packed_index(i, i+1, n), _packed_index(i, n-1, n)+1)
+            need = np.ones(len(j), dtype=bool)
+            if old[i] >= 0:
+                reuse = old[j] >= 0
+                if reuse.any():
+                    packed[dst][reuse] = previous.lookup(
+                        previous.ids[old[i]].repeat(reuse.sum()),
+                        previous.ids[old[j[reuse]]])
+                    need = ~reuse
+            if need.any():
+                jn = j[need]
+                _, _, d = _WGS84inv(np.full(len(jn), lons[i]),
+                                    np.full(len(jn), lats[i]),
+                                    lons[jn], lats[jn])
+                packed[dst][need] = d
+
+        with concurrent.futures.ThreadPoolExecutor(threads) as pool:
+            for _ in pool.map(do_row, range(n)):
+                pass
+
+        return cls(ids, lons, lats, packed)
+
+    def same_positions(self, positions):
+        """True if this matrix was computed for exactly POSITIONS."""
+        if len(positions) != len(self.ids):
+            return False
+        for id, lon, lat in zip(self.ids, self.lons, self.lats):
+            pos = positions.get(int(id))
+            if pos is None or pos.lon != lon or pos.lat != lat:
+                return False
+        return True
+
+    def save(self, fname):
+        binfile.write_arrays(fname, DISTANCE_MAGIC, DISTANCE_VERSION, {},
+                             { "ids": self.ids, "lons": self.lons,
+                               "lats": self.lats, "packed": self.packed })
+
+    @classmethod
+    def load(cls, fname):
+        _, _, arrays = binfile.read_arrays(fname, DISTANCE_MAGIC,
+                                           DISTANCE_VERSION)
+        return cls(arrays["ids"], arrays["lons"], arrays["lats"],
+                   arrays["packed"])
@@ -6,13 +6,13 @@ of geographic location, given a reference location, calibration data
 provides several different algorithms for this calculation.
 """
 
+import collections
 import numpy as np
 import pyproj
 from shapely.geometry import Point
 from shapely.ops import transform as sh_transform
 from functools import partial
 from sys import stderr
-from scipy import interpolate, stats
 
 from .calibration import PhysicalLimitsOnly
 
@@ -46,6 +46,26 @@ DISTANCE_LIMIT = 20037508
 PHYSICAL_BOUNDS  = PhysicalLimitsOnly('physical')
 EMPIRICAL_BOUNDS = PhysicalLimitsOnly('empirical')
 
+# Number of knots used to tabulate smooth ranging functions.
+KERNEL_KNOTS = 8192
+
+class Kernel(collections.namedtuple("Kernel", ("xs", "ys"))):
+    """A ranging function tabulated as a piecewise linear function of
+       distance, through the points (xs[i], ys[i]), and zero outside
+       [xs[0], xs[-1]].  Evaluating one is a single np.interp call,
+       with no temporaries beyond the result."""
+    def __call__(self, dist):
+        return np.interp(dist, self.xs, self.ys, left=0, right=0)
+
+class LogKernel(Kernel):
+    """A ranging function whose logarithm is tabulated as a piecewise
+       linear function of distance, through the points (xs[i], ys[i]),
+       and zero outside [xs[0], xs[-1]].  Suited to functions, like a
+       normal pdf, whose logarithm is much smoother than they are."""
+    def __call__(self, dist):
+        p = np.interp(dist, self.xs, self.ys, left=-np.inf, right=-np.inf)
+        return np.exp(p, out=p)
+
 class RangingFunction:
     """Abstract base class."""
 
@@ -53,13 +73,30 @@ class RangingFunction:
         self.calibration = calibration
         self.rtts = rtts
         self.fuzz = fuzz
+        self._kernel = None
 
-    def unnormalized_pvals(self, distances):
+    def kernel(self):
+        """Return this function's Kernel, computing it if necessary."""
+        if self._kernel is None:
+            self._kernel = self.make_kernel()
+        return self._kernel
+
+    def make_kernel(self):
         raise NotImplementedError
 
+    def unnormalized_pvals(self, distances):
+        return self.kernel()(distances)
+
     def distance_bound(self):
         raise NotImplementedError
 
+    def support(self):
+        """Return a pair (lo, hi) such that unnormalized_pvals is zero
+           for all distances less than LO or greater than HI.
+           Subclasses should override this if they can be more
+           precise than (0, distance_bound())."""
+        return 0, self.distance_bound()
+
 class MinMax(RangingFunction):
     """An _ideal_ min-max ranging function is a flat nonzero value
        for any distance in between the minimum and maximum distances
@@ -85,19 +122,15 @@ class MinMax(RangingFunction):
             (min_cal, max_cal, min_emp, max_emp, min_phy, max_phy)]
         self.bounds.sort()
 
-        self.interpolant = interpolate.interp1d(
-            self.bounds,
-            [0, .75, 1, 1, .75, 0],
-            kind = 'linear',
-            fill_value = 0,
-            bounds_error = False
-        )
+    def make_kernel(self):
+        return Kernel(np.array(self.bounds, dtype=np.float64),
+                      np.array([0, .75, 1, 1, .75, 0], dtype=np.float64))
 
     def distance_bound(self):
         return self.bounds[-1]
 
-    def unnormalized_pvals(self, dist):
-        return self.interpolant(dist)
+    def support(self):
+        return self.bounds[0], self.bounds[-1]
 
 class Gaussian(RangingFunction):
     """A Gaussian ranging function is simply the pdf of a normal
@@ -111,9 +144,16 @@ class Gaussian(RangingFunction):
        For the reasons discussed above, the outer distance bound for
        this function is the PHYSICAL_BOUNDS distance bound, and this
        is also used as a "clip" on the pdf (which is nonzero
-       everywhere).
+       everywhere).  The pdf is tabulated over mu +/- TAILS sigma;
+       beyond that it is below 1e-31 of its peak and is treated as 0.
+       What is tabulated is the log of the pdf, a quadratic, so the
+       relative error of the interpolation is at most
+       (2*TAILS / (KERNEL_KNOTS-1))**2 / 8, about 1.1e-6, everywhere
+       in that range, not just near the peak.
     """
 
+    TAILS = 12
+
     def __init__(self, *args, **kwargs):
         RangingFunction.__init__(self, *args, **kwargs)
         if not hasattr(self.calibration, '_mu') \
@@ -134,22 +174,28 @@ class Gaussian(RangingFunction):
         # which causes stats.norm.pdf() to spit out nothing but NaN.
         mu = max(mu, 1000)         # lower bound at 1km
         sigma = max(sigma, 1000/3) # lower bound at 3sigma=1km
-        self._distribution = stats.norm(
-            loc   = mu,
-            scale = sigma
-        )
+        if not (np.isfinite(mu) and np.isfinite(sigma)):
+            ve = ValueError("pdf parameters are not finite")
+            ve.req_range = (mu, sigma)
+            ve.range_fn = self
+            raise ve
+        self._mu = mu
+        self._sigma = sigma
+
+    def make_kernel(self):
+        lo, hi = self.support()
+        if lo >= hi:
+            return Kernel(np.array([0.]), np.array([0.]))
+        xs = np.linspace(lo, hi, KERNEL_KNOTS)
+        ys = xs - self._mu
+        ys *= ys
+        ys *= -0.5 / (self._sigma * self._sigma)
+        ys -= np.log(self._sigma * np.sqrt(2*np.pi))
+        return LogKernel(xs, ys)
 
     def distance_bound(self):
         return self._distance_bound
 
-    def unnormalized_pvals(self, dist):
-        rv = self._distribution.pdf(dist)
-        if not np.isfinite(rv).all():
-            ve = ValueError("pdf returned non-finite values")
-            ve.req_domain = dist
-            ve.req_range = rv
-            ve.range_fn = self
-            raise ve
-
-        rv[dist > self._distance_bound] = 0
-        return rv
+    def support(self):
+        return (max(0, self._mu - self.TAILS * self._sigma),
+                min(self._distance_bound, self._mu + self.TAILS * self._sigma))
@@ -5,6 +5,10 @@ raster file (assumed to be a map of the Earth), resampling as
 necessary.  The value assigned to each matrix point is logarithmically
 proportional to the value in each raster cell, and normalized to [0, 1].
 Cells with missing data are assigned value 0.
+
+The raster is reprojected a band of rows at a time, straight into the
+output file, so memory use is bounded by --tile-rows rather than by
+the size of the matrix.
 """
 
 import argparse
@@ -79,37 +83,73 @@ class GeographicMatrix:
         self.lon         = lon
         self.lat         = lat
 
-        mtx = np.empty((n_lat, n_lon), dtype=np.float32)
+        self.raster      = args.raster
+        self.tile_rows   = args.tile_rows
+        self.dst_crs     = rasterio.crs.CRS({
+            'proj': 'longlat', 'ellps': 'WGS84', 'datum': 'WGS84',
+            'no_defs': True})
+        self.dst_transform = rasterio.transform.from_bounds(
+            west, south, east, north, n_lon, n_lat)
+
+    def tiles(self):
+        """Yield (lo, hi) row ranges covering the matrix, in the
+           north-up order of the reprojection."""
+        n_lat = len(self.lat)
+        for lo in range(0, n_lat, self.tile_rows):
+            yield lo, min(n_lat, lo + self.tile_rows)
+
+    def reproject_tile(self, lo, hi):
+        """Reproject rows LO through HI-1 (counting from the north) of
+           the matrix, and return their log-scaled values."""
+        tile = np.empty((hi - lo, len(self.lon)), dtype=np.float32)
         rasterio.warp.reproject(
-            rasterio.band(args.raster, 1),
-            mtx,
-            src_transform = args.raster.affine,
-            src_crs       = args.raster.crs,
-            dst_crs       = rasterio.crs.CRS({
-                'proj': 'longlat', 'ellps': 'WGS84', 'datum': 'WGS84',
-                'no_defs': True}),
-            dst_transform = rasterio.transform.from_bounds(
-                west, south, east, north,
-                n_lon, n_lat),
+            rasterio.band(self.raster, 1),
+            tile,
+            src_transform = self.raster.affine,
+            src_crs       = self.raster.crs,
+            dst_crs       = self.dst_crs,
+            dst_transform = (self.dst_transform
+                             * rasterio.Affine.translation(0, lo)),
             dst_nodata    = 0,
             resampling    = rasterio.warp.Resampling.cubic)
 
-        mtx[mtx < 0] = 0
-        mtx  = np.log1p(mtx)
-        mtx -= np.amin(mtx)
-        mtx /= np.amax(mtx)
-
-        # For no reason that I can find, 'mtx' will come out upside down.
-        self.mtx = np.flipud(mtx)
+        np.maximum(tile, 0, out=tile)
+        np.log1p(tile, out=tile)
+        return tile
+
+    def fill(self, M):
+        """Fill the carray M with the normalized matrix, in two passes:
+           the first reprojects each tile only to find the range of the
+           values, the second reprojects it again, rescales it, and
+           writes it.  Each chunk of M is therefore compressed and
+           written once, at the cost of reprojecting twice."""
+        n_lat = len(self.lat)
+        lo_val = np.inf
+        hi_val = -np.inf
+
+        for lo, hi in self.tiles():
+            tile = self.reproject_tile(lo, hi)
+            lo_val = min(lo_val, float(tile.min()))
+            hi_val = max(hi_val, float(tile.max()))
+
+        scale = hi_val - lo_val
+        for lo, hi in self.tiles():
+            tile = self.reproject_tile(lo, hi)
+            tile -= lo_val
+            tile /= scale
+
+            # The reprojection is north-up, but the matrix is stored
+            # with latitude increasing along the first axis.
+            M[n_lat - hi : n_lat - lo, :] = tile[::-1]
 
     def write_to(self, fname):
         with tables.open_file(fname, 'w') as f:
             M = f.create_carray(f.root, 'baseline',
-                                tables.Atom.from_dtype(self.mtx.dtype),
-                                self.mtx.shape,
+                                tables.Float32Atom(),
+                                (len(self.lat), len(self.lon)),
                                 filters=tables.Filters(complevel=6,
                                                        complib='zlib'))
-            M[:,:] = self.mtx[:,:]
+            self.fill(M)
 
             M.attrs.resolution  = self.resolution
             M.attrs.fuzz        = self.fuzz
@@ -167,6 +207,10 @@ def main():
     ap.add_argument('-o', '--output', default=None,
                     help='Name of output file.  The default is to use the '
                     'name of the input shapefile, with a ".hdf" suffix.')
+    ap.add_argument('-t', '--tile-rows', type=int, default=1024,
+                    help='Number of matrix rows to reproject at once.  '
+                    'Memory use is proportional to this times the width '
+                    'of the matrix.  The default is 1024.')
 
     ap.add_argument('raster', type=rasterfile,
                     help='Raster file to process.')
@@ -179,6 +223,9 @@ def main():
     if not (-90 <= args.south < args.north < 90):
         ap.error("improper values for --south/--north")
 
+    if args.tile_rows < 1:
+        ap.error("--tile-rows must be positive")
+
     if args.output is None:
         args.output = os.path.splitext(args.raster.name)[0] + '.hdf'
 
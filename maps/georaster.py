@@ -0,0 +1,274 @@
+"""Rasterize polygons onto a regular longitude/latitude grid.
+
+This is used by make_geog_baseline.py.  Polygons are burned into the
+grid with a scanline fill, and the "fuzz" band just outside them is
+found with an exact distance transform restricted to the band: each
+boundary segment computes its distance to just the grid points within
+the fuzz radius of it.  Neither step needs per-point geometric
+predicates.  Both work on bands of grid rows, which are processed in
+parallel.
+
+Grids are described by two sorted vectors, LON and LAT, of the grid
+point coordinates; masks and matrices are indexed [lat, lon].
+Coordinates and distances are in degrees, as for shapely geometry in
+"latlong" coordinates.
+"""
+
+import concurrent.futures
+
+import numpy as np
+
+# Number of grid rows handled by each task.
+BAND_ROWS = 64
+
+# Most (segment, grid point) pairs evaluated at once by
+# boundary_distance.
+PAIR_CHUNK = 1 << 20
+
+def _polygons(geom):
+    """Yield every Polygon in GEOM, which may be a Polygon, a
+       MultiPolygon, or a GeometryCollection."""
+    if geom.is_empty:
+        return
+    if geom.geom_type == 'Polygon':
+        yield geom
+    elif hasattr(geom, 'geoms'):
+        for g in geom.geoms:
+            yield from _polygons(g)
+
+def _rings(geom):
+    rings = []
+    for p in _polygons(geom):
+        rings.append(np.asarray(p.exterior.coords)[:, :2])
+        rings.extend(np.asarray(r.coords)[:, :2] for r in p.interiors)
+    return rings
+
+class EdgeTable:
+    """The non-horizontal edges of all the rings of a polygonal
+       geometry, sorted by their lower y-coordinate."""
+
+    def __init__(self, geom):
+        rings = _rings(geom)
+        if rings:
+            x0 = np.concatenate([r[:-1, 0] for r in rings])
+            y0 = np.concatenate([r[:-1, 1] for r in rings])
+            x1 = np.concatenate([r[1:, 0] for r in rings])
+            y1 = np.concatenate([r[1:, 1] for r in rings])
+        else:
+            x0 = y0 = x1 = y1 = np.zeros(0)
+
+        keep = y0 != y1
+        x0, y0, x1, y1 = x0[keep], y0[keep], x1[keep], y1[keep]
+        self.ylo = np.minimum(y0, y1)
+        self.yhi = np.maximum(y0, y1)
+        order = np.argsort(self.ylo, kind='stable')
+        self.ylo = self.ylo[order]
+        self.yhi = self.yhi[order]
+        self.x0 = x0[order]
+        self.y0 = y0[order]
+        self.slope = ((x1 - x0) / (y1 - y0))[order]
+
+    def within(self, south, north):
+        """Indices of the edges that overlap the latitude range
+           [SOUTH, NORTH]."""
+        k = np.searchsorted(self.ylo, north, side='right')
+        return np.nonzero(self.yhi[:k] > south)[0]
+
+class SegmentTable:
+    """All the edges of all the rings of a polygonal geometry, cut
+       into pieces no longer than MAX_LENGTH, sorted by their lower
+       y-coordinate."""
+
+    def __init__(self, geom, max_length):
+        rings = _rings(geom)
+        if rings:
+            x0 = np.concatenate([r[:-1, 0] for r in rings])
+            y0 = np.concatenate([r[:-1, 1] for r in rings])
+            x1 = np.concatenate([r[1:, 0] for r in rings])
+            y1 = np.concatenate([r[1:, 1] for r in rings])
+        else:
+            x0 = y0 = x1 = y1 = np.zeros(0)
+
+        pieces = np.maximum(1, np.ceil(np.hypot(x1 - x0, y1 - y0)
+                                       / max_length)).astype(np.intp)
+        seg = np.repeat(np.arange(len(x0)), pieces)
+        k = np.arange(len(seg)) - np.repeat(np.cumsum(pieces) - pieces,
+                                            pieces)
+        t0 = k / pieces[seg]
+        t1 = (k + 1) / pieces[seg]
+        dx = (x1 - x0)[seg]
+        dy = (y1 - y0)[seg]
+        self.x0 = x0[seg] + t0 * dx
+        self.y0 = y0[seg] + t0 * dy
+        self.x1 = x0[seg] + t1 * dx
+        self.y1 = y0[seg] + t1 * dy
+
+        self.ylo = np.minimum(self.y0, self.y1)
+        self.yhi = np.maximum(self.y0, self.y1)
+        order = np.argsort(self.ylo, kind='stable')
+        for attr in ('x0', 'y0', 'x1', 'y1', 'ylo', 'yhi'):
+            setattr(self, attr, getattr(self, attr)[order])
+
+    def within(self, south, north):
+        """Indices of the segments that overlap the latitude range
+           [SOUTH, NORTH]."""
+        k = np.searchsorted(self.ylo, north, side='right')
+        return np.nonzero(self.yhi[:k] >= south)[0]
+
+def boundary_distance(segments, lon, lat, radius):
+    """Distance from each point of the grid LON x LAT to the nearest
+       segment of SEGMENTS (a SegmentTable), for points within RADIUS
+       of some segment; other points get infinity.  Each segment is
+       paired with the grid points in its bounding box, widened by
+       RADIUS, which is why the segments must be short."""
+    dist = np.full((len(lat), len(lon)), np.inf)
+    if not len(lat):
+        return dist
+    band = segments.within(lat[0] - radius, lat[-1] + radius)
+    if not len(band):
+        return dist
+    x0 = segments.x0[band]
+    y0 = segments.y0[band]
+    x1 = segments.x1[band]
+    y1 = segments.y1[band]
+
+    ia = np.searchsorted(lon, np.minimum(x0, x1) - radius, side='left')
+    ib = np.searchsorted(lon, np.maximum(x0, x1) + radius, side='right')
+    ja = np.searchsorted(lat, np.minimum(y0, y1) - radius, side='left')
+    jb = np.searchsorted(lat, np.maximum(y0, y1) + radius, side='right')
+    ni = np.maximum(ib - ia, 0)
+    nj = np.maximum(jb - ja, 0)
+    n = ni * nj
+    sdx = x1 - x0
+    sdy = y1 - y0
+
+    # Process the segments in runs of about PAIR_CHUNK pairs, so that
+    # memory use does not depend on how detailed the boundary is.
+    ends = np.cumsum(n)
+    cuts = np.searchsorted(ends, np.arange(PAIR_CHUNK, ends[-1], PAIR_CHUNK),
+                           side='left') + 1
+    flat = dist.reshape(-1)
+    for lo, hi in zip(np.append(0, cuts), np.append(cuts, len(n))):
+        if lo >= hi:
+            continue
+        nc = n[lo:hi]
+        total = int(nc.sum())
+        if not total:
+            continue
+
+        # Expand every (segment, grid point) pair.
+        seg = lo + np.repeat(np.arange(hi - lo), nc)
+        k = np.arange(total) - np.repeat(np.cumsum(nc) - nc, nc)
+        i = ia[seg] + k % ni[seg]
+        j = ja[seg] + k // ni[seg]
+
+        px = lon[i] - x0[seg]
+        py = lat[j] - y0[seg]
+        dx = sdx[seg]
+        dy = sdy[seg]
+        len2 = dx*dx + dy*dy
+        with np.errstate(invalid='ignore', divide='ignore'):
+            t = np.where(len2 > 0, (px*dx + py*dy) / len2, 0)
+        t = np.clip(t, 0, 1)
+        d = np.hypot(px - t*dx, py - t*dy)
+
+        np.minimum.at(flat, j * len(lon) + i, d)
+    return dist
+
+def fill_rows(edges, lon, lat):
+    """Scanline fill: a boolean mask of shape (len(LAT), len(LON)),
+       true at the grid points strictly inside the polygons of EDGES
+       (an EdgeTable).  An edge crosses row y if ylo <= y < yhi, which
+       counts each vertex once and so keeps the number of crossings on
+       every row even."""
+    mask = np.zeros((len(lat), len(lon)), dtype=bool)
+    if not len(lat):
+        return mask
+    band = edges.within(lat[0], lat[-1])
+    ylo = edges.ylo[band]
+    yhi = edges.yhi[band]
+    x0 = edges.x0[band]
+    y0 = edges.y0[band]
+    slope = edges.slope[band]
+
+    n_lon = len(lon)
+    for r, y in enumerate(lat):
+        active = (ylo <= y) & (yhi > y)
+        if not active.any():
+            continue
+        xs = np.sort(x0[active] + (y - y0[active]) * slope[active])
+        a = np.searchsorted(lon, xs[0::2], side='right')
+        b = np.searchsorted(lon, xs[1::2], side='left')
+        runs = np.zeros(n_lon + 1, dtype=np.int32)
+        np.add.at(runs, a, 1)
+        np.add.at(runs, b, -1)
+        mask[r] = np.cumsum(runs[:-1]) > 0
+    return mask
+
+def _bands(n, size):
+    return [(lo, min(n, lo + size)) for lo in range(0, n, size)]
+
+def rasterize(geom, lon, lat, fuzz, *, threads=None):
+    """Rasterize GEOM onto the grid LON x LAT.  Returns a float32
+       matrix which is 1 at grid points inside GEOM, falls off linearly
+       from 1 on its boundary to 0 at distance FUZZ outside it, and is
+       0 beyond that.
+    """
+    lon = np.asarray(lon, dtype=np.float64)
+    lat = np.asarray(lat, dtype=np.float64)
+    n_lat, n_lon = len(lat), len(lon)
+    lon_step = (lon[-1] - lon[0]) / (n_lon - 1) if n_lon > 1 else 1.
+    lat_step = (lat[-1] - lat[0]) / (n_lat - 1) if n_lat > 1 else 1.
+
+    edges = EdgeTable(geom)
+    segments = SegmentTable(geom, max(lon_step, lat_step))
+    result = np.zeros((n_lat, n_lon), dtype=np.float32)
+
+    def do_band(band):
+        lo, hi = band
+        inside = fill_rows(edges, lon, lat[lo:hi])
+        if fuzz > 0:
+            dist = boundary_distance(segments, lon, lat[lo:hi], fuzz)
+            val = 1 - np.clip(dist / fuzz, 0, 1)
+        else:
+            val = np.zeros(inside.shape)
+        val[inside] = 1
+        result[lo:hi] = val
+
+    with concurrent.futures.ThreadPoolExecutor(threads) as pool:
+        for _ in pool.map(do_band, _bands(n_lat, BAND_ROWS)):
+            pass
+
+    return result
+
+def label_regions(geoms, lon, lat, radius, *, threads=None):
+    """Label each point of the grid LON x LAT with 1 + the index of the
+       first geometry in GEOMS that it lies within RADIUS of, or with 0
+       if there is no such geometry.  Returns a uint16 matrix.  Each
+       geometry is only rasterized over its own bounding box.
+    """
+    if len(geoms) >= np.iinfo(np.uint16).max:
+        raise ValueError("too many regions for a uint16 label grid: {}"
+                         .format(len(geoms)))
+
+    lon = np.asarray(lon, dtype=np.float64)
+    lat = np.asarray(lat, dtype=np.float64)
+    labels = np.zeros((len(lat), len(lon)), dtype=np.uint16)
+
+    for k, geom in enumerate(geoms):
+        if geom.is_empty:
+            continue
+        west, south, east, north = geom.bounds
+        i0 = np.searchsorted(lon, west - radius, side='left')
+        i1 = np.searchsorted(lon, east + radius, side='right')
+        j0 = np.searchsorted(lat, south - radius, side='left')
+        j1 = np.searchsorted(lat, north + radius, side='right')
+        if i0 >= i1 or j0 >= j1:
+            continue
+
+        near = rasterize(geom, lon[i0:i1], lat[j0:j1], radius,
+                         threads=threads) > 0
+        box = labels[j0:j1, i0:i1]
+        box[near & (box == 0)] = k + 1
+
+    return labels
@@ -25,9 +25,10 @@ import pyproj
 import shapely
 import shapely.geometry
 import shapely.ops
-import shapely.prepared
 import tables
 
+import georaster
+
 from fiona.errors import FionaValueError
 from argparse import ArgumentTypeError
 
@@ -150,27 +151,13 @@ class GeographicMatrix:
                 pyproj.Proj(proj="latlong", datum="WGS84", ellps="WGS84")),
             inner_boundary)
 
-        outer_boundary = inner_boundary.buffer(self.fuzz_deg)
-
-        inner_boundary_p = shapely.prepared.prep(inner_boundary)
-        outer_boundary_p = shapely.prepared.prep(outer_boundary)
-
-        for i, x in enumerate(self.lon):
-            for j, y in enumerate(self.lat):
-                pt = shapely.geometry.Point(x, y)
-                if inner_boundary_p.contains(pt):
-                    val = 1
-                elif not outer_boundary_p.contains(pt):
-                    val = 0
-                else:
-                    # in between
-                    val = 1 - min(1, max(0,
-                        pt.distance(inner_boundary)/self.fuzz_deg))
-
-                if sense == '+':
-                    self.mtx[j,i] = min(1, self.mtx[j,i] + val)
-                else:
-                    self.mtx[j,i] = max(0, self.mtx[j,i] - val)
+        val = georaster.rasterize(inner_boundary, self.lon, self.lat,
+                                  self.fuzz_deg)
+
+        if sense == '+':
+            np.minimum(1, self.mtx + val, out=self.mtx)
+        else:
+            np.maximum(0, self.mtx - val, out=self.mtx)
 
 def process(args):
     matrix = GeographicMatrix(args)
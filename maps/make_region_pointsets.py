@@ -11,6 +11,7 @@ import csv
 import datetime
 import functools
 import math
+import multiprocessing
 import os
 import re
 import sys
@@ -18,14 +19,16 @@ import time
 
 import fiona
 import fiona.crs
+import numpy as np
 import pyproj
 import scipy.sparse
 import shapely
 import shapely.geometry
 import shapely.ops
-import shapely.prepared
 import tables
 
+import georaster
+
 from fiona.errors import FionaValueError
 from argparse import ArgumentTypeError
 
@@ -63,14 +66,32 @@ def to_h5filename(d, s):
 # format used by ageo.Map.
 class RegionRowOnDisk(tables.IsDescription):
     """The row format of the pytables table used to save regions
-       on disk.  See GeographicMatrix.carve_region; also see
-       ageo.Location.save and ageo.Location.load."""
+       on disk.  See write_pointset and GeographicMatrix.pointset_rows;
+       also see ageo.Location.save and ageo.Location.load."""
     grid_x    = tables.UInt32Col()
     grid_y    = tables.UInt32Col()
     longitude = tables.Float64Col()
     latitude  = tables.Float64Col()
     prob_mass = tables.Float32Col()
 
+def write_pointset(odir, fname, attrs, rows):
+    """Write ROWS, a record array with the columns of RegionRowOnDisk,
+       to the pointset file for FNAME in ODIR, with ATTRS as the
+       attributes of its table."""
+    with tables.open_file(to_h5filename(odir, fname), "w") as f:
+        t = f.create_table(f.root, "location",
+                           RegionRowOnDisk, "location",
+                           expectedrows=max(1, len(rows)))
+        for k, v in attrs.items():
+            setattr(t.attrs, k, v)
+        if len(rows):
+            t.append(rows)
+        t.flush()
+    return fname
+
+def _write_pointset_job(job):
+    return write_pointset(*job)
+
 class GeographicMatrix:
     def __init__(self, basefile):
         M = basefile.root.baseline
@@ -87,7 +108,7 @@ class GeographicMatrix:
                         len(M.attrs.longitudes),
                         len(M.attrs.latitudes)))
 
-        self.points      = list(zip(*scipy.sparse.find(matrix)))
+        self.grid_x, self.grid_y, self.prob_mass = scipy.sparse.find(matrix)
         self.resolution  = M.attrs.resolution
         self.fuzz        = M.attrs.fuzz
         self.fuzz_deg    = fuzz_to_degrees(self.fuzz)
@@ -100,61 +121,68 @@ class GeographicMatrix:
         self.longitudes  = M.attrs.longitudes
         self.latitudes   = M.attrs.latitudes
 
-    def write_pointset(self, odir, fname, rows):
-        with tables.open_file(to_h5filename(odir, fname), "w") as f:
-            t = f.create_table(f.root, "location",
-                               RegionRowOnDisk, "location")
-            t.attrs.resolution  = self.resolution
-            t.attrs.fuzz        = self.fuzz
-            t.attrs.north       = self.north
-            t.attrs.south       = self.south
-            t.attrs.east        = self.east
-            t.attrs.west        = self.west
-            t.attrs.lon_spacing = self.lon_spacing
-            t.attrs.lat_spacing = self.lat_spacing
-            t.attrs.lon_count   = len(self.longitudes)
-            t.attrs.lat_count   = len(self.latitudes)
-
-            cur = t.row
-            for i, j, lon, lat, pmass in rows:
-                cur['grid_x']    = i
-                cur['grid_y']    = j
-                cur['longitude'] = lon
-                cur['latitude']  = lat
-                cur['prob_mass'] = pmass
-                cur.append()
-
-            t.flush()
-
-    def carve_region(self, projection, region_name, region_geometry, odir):
-
-        boundary = shapely.prepared.prep(
+    def table_attrs(self):
+        return {
+            'resolution':  self.resolution,
+            'fuzz':        self.fuzz,
+            'north':       self.north,
+            'south':       self.south,
+            'east':        self.east,
+            'west':        self.west,
+            'lon_spacing': self.lon_spacing,
+            'lat_spacing': self.lat_spacing,
+            'lon_count':   len(self.longitudes),
+            'lat_count':   len(self.latitudes),
+        }
+
+    def pointset_rows(self, sel):
+        """The rows of the pointset made up of the nonzero points
+           selected by the boolean vector SEL."""
+        gx = self.grid_x[sel]
+        gy = self.grid_y[sel]
+        rows = np.empty(len(gx), dtype=tables.dtype_from_descr(
+            RegionRowOnDisk))
+        rows['grid_x']    = gx
+        rows['grid_y']    = gy
+        rows['longitude'] = self.longitudes[gx]
+        rows['latitude']  = self.latitudes[gy]
+        rows['prob_mass'] = self.prob_mass[sel]
+        return rows
+
+    def label_points(self, projection, regions):
+        """Assign each nonzero point to the first of REGIONS (a list of
+           lists of shapefile geometries) whose boundary, widened by the
+           fuzz radius, contains it.  Returns a vector parallel to the
+           points, holding 1 + the index of that region, or 0 if none.
+           The regions are rasterized once into a label grid, so each
+           point is only looked up, not tested against each region.
+        """
+        boundaries = [
             shapely.ops.unary_union([
                 shapely.ops.transform(
                     functools.partial(
                         pyproj.transform, projection, WGS84proj),
                     shapely.geometry.shape(geom))
                 for geom in region_geometry
-            ]).buffer(self.fuzz_deg))
-
-        within = []
-        without = []
-        for i, j, v in self.points:
-            lon = self.longitudes[i]
-            lat = self.latitudes[j]
-            if boundary.contains(shapely.geometry.Point(lon, lat)):
-                within.append((i, j, lon, lat, v))
-            else:
-                without.append((i, j, v))
-
-        self.write_pointset(odir, region_name, within)
-        self.points = without
-
-    def write_remaining(self, odir):
-        self.write_pointset(odir, 'other', (
-            (i, j, self.longitudes[i], self.latitudes[j], v)
-            for i, j, v in self.points
-        ))
+            ])
+            for region_geometry in regions
+        ]
+        labels = georaster.label_regions(boundaries,
+                                         self.longitudes, self.latitudes,
+                                         self.fuzz_deg)
+        return labels[self.grid_y, self.grid_x]
+
+    def write_pointsets(self, odir, names, labels, pool):
+        """Write one pointset for each region in NAMES, plus 'other' for
+           the points not in any region, using LABELS as returned by
+           label_points.  The files are written in parallel by POOL."""
+        attrs = self.table_attrs()
+        jobs = [(odir, name, attrs, self.pointset_rows(labels == k + 1))
+                for k, name in enumerate(names)]
+        jobs.append((odir, 'other', attrs, self.pointset_rows(labels == 0)))
+
+        for name in pool.imap_unordered(_write_pointset_job, jobs):
+            progress("{} written.", name)
 
 class RegionLabeler:
     def __init__(self, override):
@@ -226,12 +254,13 @@ def main():
     for rgn in args.shapefile:
         regions[region_labels[rgn]].append(rgn['geometry'])
 
-    for label, geoms in regions.items():
-        progress(label + "...")
-        world.carve_region(projection, label, geoms, args.odir)
+    names = list(regions.keys())
+    progress("labeling {} regions...", len(names))
+    labels = world.label_points(projection, [regions[n] for n in names])
 
-    progress("other...\n")
-    world.write_remaining(args.odir)
+    progress("writing pointsets...")
+    with multiprocessing.Pool() as pool:
+        world.write_pointsets(args.odir, names, labels, pool)
 
     progress("done.")
 
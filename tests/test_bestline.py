@@ -0,0 +1,77 @@
+#! /usr/bin/python3
+
+"""Cross-check ageo.bestline.solve_bestline against the general linear
+program it replaces.  Run with: python3 -m unittest discover tests"""
+
+import os
+import sys
+import unittest
+
+import numpy as np
+from scipy import optimize
+
+sys.path.append(os.path.abspath(os.path.join(os.path.dirname(__file__),
+                                             '..', 'lib')))
+from ageo.bestline import solve_bestline
+
+def linprog_bestline(cx, cy, xbar, m_min, b_max):
+    """The same problem, stated for optimize.linprog."""
+    return optimize.linprog(
+        np.array([0, -xbar, -1]),
+        A_ub=np.column_stack((np.zeros_like(cx), cx, np.ones_like(cx))),
+        b_ub=cy,
+        bounds=[(1, 1), (m_min, None), (0, b_max)],
+        method='highs')
+
+class TestSolveBestline(unittest.TestCase):
+
+    def check_against_linprog(self, cx, cy, xbar, m_min, b_max):
+        fit = solve_bestline(cx, cy, xbar, m_min, b_max)
+        ref = linprog_bestline(cx, cy, xbar, m_min, b_max)
+        self.assertEqual(fit.success, ref.success)
+        if not fit.success:
+            return
+
+        _, m, b = fit.x
+        scale = max(1, np.amax(np.abs(cy)))
+        self.assertGreaterEqual(m, m_min - 1e-12)
+        self.assertGreaterEqual(b, -1e-9 * scale)
+        self.assertLessEqual(b, b_max + 1e-9 * scale)
+        self.assertTrue(np.all(m * cx + b <= cy + 1e-9 * scale))
+
+        # The optimum need not be unique, so compare objective values.
+        self.assertAlmostEqual(m * xbar + b,
+                               ref.x[1] * xbar + ref.x[2],
+                               delta=1e-7 * scale)
+
+    def test_random_problems(self):
+        rng = np.random.default_rng(20181121)
+        for _ in range(2000):
+            n = rng.integers(1, 40)
+            cx = rng.uniform(0, 2e7, n)
+            if rng.random() < 0.2:
+                cx[rng.integers(0, n)] = 0
+            cy = cx * rng.uniform(1e-5, 3e-5) + rng.uniform(0, 50, n)
+            if rng.random() < 0.1:
+                cy[rng.integers(0, n)] = rng.uniform(-5, 5)
+            xbar = rng.uniform(1, 2e7)
+            m_min = rng.choice([1e-5, 0., 5e-5])
+            b_max = rng.choice([np.amin(cy), rng.uniform(0, 60)])
+            self.check_against_linprog(cx, cy, xbar, m_min, b_max)
+
+    def test_xbar_on_hull_vertex(self):
+        # XBAR exactly at a vertex of the lower hull: any slope
+        # between those of the two adjacent edges is optimal.
+        cx = np.array([1000., 2000., 3000., 4000.])
+        cy = np.array([10., 11., 13., 16.])
+        for xbar in cx:
+            for b_max in (0., 5., 20.):
+                self.check_against_linprog(cx, cy, xbar, 1e-5, b_max)
+
+    def test_negative_distance_rejected(self):
+        fit = solve_bestline(np.array([-1., 2.]), np.array([1., 2.]),
+                             1., 0., 1.)
+        self.assertFalse(fit.success)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -11,6 +11,7 @@ from werkzeug.exceptions import HTTPException
 import agapi
 import database
 import ipgeo
+import lmindex
 
 app = flask.Flask(__name__, instance_relative_config=True)
 app.config.from_object('config_defaults')
@@ -21,8 +22,10 @@ def expand_relative_config_paths():
     if not base_dir: base_dir = '.'
     base_dir = os.path.abspath(os.path.join(app.instance_path, base_dir))
 
-    for k in 'REPORT_DIR', 'GPG_HOME', 'GEOIP_DB':
-        app.config[k] = os.path.abspath(os.path.join(base_dir, app.config[k]))
+    for k in 'REPORT_DIR', 'GPG_HOME', 'GEOIP_DB', 'LANDMARK_INDEX_STAMP':
+        if app.config[k] is not None:
+            app.config[k] = os.path.abspath(os.path.join(base_dir,
+                                                         app.config[k]))
 
 expand_relative_config_paths()
 
@@ -33,6 +36,11 @@ lmdb = database.ThreadedExpiringConnectionPool(
     max_idle_time = app.config['LANDMARK_DB_MAXIDLE'],
     **app.config['LANDMARK_DB']
 )
+lmidx = lmindex.LandmarkIndex(
+    lambda: agapi.usable_landmarks(lmdb),
+    stamp_file = app.config['LANDMARK_INDEX_STAMP'],
+    max_age = app.config['LANDMARK_INDEX_MAXAGE']
+)
 
 @app.context_processor
 def augment_template_context():
@@ -86,7 +94,7 @@ def continent_marks():
 
 @app.route('/api/1/local-marks')
 def local_marks():
-    return agapi.local_marks(flask.request, app.config, app.logger, lmdb)
+    return agapi.local_marks(flask.request, app.config, app.logger, lmidx)
 
 @app.route('/api/1/probe-results', methods=['POST'])
 def probe_results():
@@ -163,11 +163,28 @@ def continent_marks(request, config, log, db):
 
     return flask.jsonify(sorted(tuple(x) for x in set(data)))
 
-def local_marks(request, config, log, db):
+def usable_landmarks(db):
+    """Return the complete list of usable landmarks (not just
+       anchors), with locations and CBG calibration parameters.
+       This is what lmindex.LandmarkIndex is built from.
+    """
+    with get_db_cursor(db) as cur:
+        cur.execute("""
+            SELECT addr, 80 AS port,
+                   ST_Y(location::GEOMETRY) as lat,
+                   ST_X(location::GEOMETRY) as lon,
+                   COALESCE(cbg_m, 100000) AS m, COALESCE(cbg_b, 0) AS b
+              FROM landmarks
+             WHERE usable
+        """)
+        return [lm_entry_with_location(row) for row in cur]
+
+def local_marks(request, config, log, lmidx):
     """Return the subset of all available landmarks which are within a
        useful striking distance of a particular location, expressed as
        a set of (longitude, latitude, radius) triples; the location is
-       where all the disks intersect.
+       where all the disks intersect.  Landmarks are looked up in
+       LMIDX, an lmindex.LandmarkIndex.
     """
     bad_request = functools.partial(bad_request_, request, log)
 
@@ -210,48 +227,28 @@ def local_marks(request, config, log, db):
     if len(lats) != len(lons) or len(lons) != len(rads):
         bad_request("wrong number of values for a query key")
 
-    # Process the disks from smallest to largest.
-    disks = sorted(zip(lons, lats, rads), key = lambda d: d[2])
-
+    disks = list(zip(lons, lats, rads))
+
+    # Rather than attempting to _compute_ the intersection of all
+    # the disks, we simply ask the landmark index for "within X
+    # meters of point (A,B) AND within Y meters of point (C,D) AND
+    # ..." -- this is more likely to do the Right Thing when some of
+    # the circles are very large and/or cross the poles or the
+    # antimeridian.  If there are not enough landmarks in the
+    # intersection, all the disks are progressively enlarged.
+    #
+    # Note that unlike the above two queries, this one is not
+    # limited to anchors.
+    lmset = lmidx.get()
     sample = []
     scale = -1000 * 1000
     scaledelta = max(1000 * 1000, 4 * neighbor_dist)
-    with get_db_cursor(db) as cur:
-        while len(sample) < n and scale < 10018750:
-            # Construct a SQL query which will retrieve all of the
-            # probes that are within the intersection of all the
-            # requested disks.  Rather than attempting to _compute_
-            # that intersection, we simply ask the database for
-            # "within X meters of point (A,B) AND within Y meters of
-            # point (C,D) AND ..." -- this is probably just as fast
-            # for short lists of disks, and is more likely to do the
-            # Right Thing when some of the circles are very large
-            # and/or cross the poles or the antimeridian.
-            #
-            # Note that unlike the above two queries, this one is not
-            # limited to anchors.  Logic above has ensured that
-            # 'lats', 'lons', and 'rads' contain only floats, so the
-            # SQL string bashing below is injection-safe.
-            query = """
-                SELECT addr, 80 AS port,
-                       ST_Y(location::GEOMETRY) as lat,
-                       ST_X(location::GEOMETRY) as lon,
-                       COALESCE(cbg_m, 100000) AS m, COALESCE(cbg_b, 0) AS b
-                  FROM landmarks
-                 WHERE usable
-            """
-            query += "\n".join(
-            "AND ST_DWithin(location, 'SRID=4326;POINT({} {})'::GEOGRAPHY, {})"
-                .format(lon, lat, rad + scale)
-                for lon, lat, rad in disks)
-
-            cur.execute(query)
-
-            geometry.sample_more_tuples_into(
-                sample, n, neighbor_dist,
-                (lm_entry_with_location(row) for row in cur))
-
-            scale += scaledelta
+    while len(sample) < n and scale < 10018750:
+        geometry.sample_more_tuples_into(
+            sample, n, neighbor_dist,
+            lmset.within_disks(disks, scale))
+
+        scale += scaledelta
 
     if not sample:
         # Treating this as a bad request simplifies the client.
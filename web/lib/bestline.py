@@ -0,0 +1 @@
+../../lib/ageo/bestline.py
\ No newline at end of file
@@ -18,5 +18,12 @@ LANDMARK_DB_MINCONN = 1
 LANDMARK_DB_MAXCONN = 10
 LANDMARK_DB_MAXIDLE = 600  # per-connection max idle time in seconds
 
+# The landmark index used by the local-marks API is rebuilt whenever
+# this file, which scripts/update_ripe_probes.py --stamp-file rewrites,
+# changes; or, if it is None or does not exist, every
+# LANDMARK_INDEX_MAXAGE seconds.
+LANDMARK_INDEX_STAMP  = None
+LANDMARK_INDEX_MAXAGE = 3600
+
 # Misc
 ENCRYPT_TO  = None # set this to a GnuPG keyid to enable encryption
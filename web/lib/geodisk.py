@@ -0,0 +1 @@
+../../lib/ageo/geodisk.py
\ No newline at end of file
@@ -0,0 +1,131 @@
+"""
+In-memory spatial index of the usable landmarks, for answering
+"which landmarks are within all of these disks" without a database
+round trip.
+"""
+
+import math
+import os
+import threading
+import time
+
+import numpy as np
+import pyproj
+from scipy.spatial import cKDTree
+
+import geodisk
+
+WGS84geod = pyproj.Geod(ellps='WGS84')
+
+# Ball queries against the k-d tree are made on a sphere of this
+# radius, padded by a factor and a constant to allow for the
+# flattening (see geodisk.cap_bounds); candidates are then checked
+# against the exact geodesic distance.
+SPHERE_RADIUS = geodisk.MEAN_RADIUS
+SLACK = 1.01
+PAD = 1000
+
+def unit_vectors(lons, lats):
+    """Points on the unit sphere corresponding to LONS and LATS (in
+       degrees), treating geodetic latitude as spherical latitude."""
+    lam = np.radians(np.asarray(lons, dtype=np.float64))
+    phi = np.radians(np.asarray(lats, dtype=np.float64))
+    cphi = np.cos(phi)
+    return np.column_stack((cphi * np.cos(lam),
+                            cphi * np.sin(lam),
+                            np.sin(phi)))
+
+class LandmarkSet:
+    """An immutable set of landmarks, which must have 'lon' and 'lat'
+       properties, indexed by position."""
+
+    def __init__(self, landmarks):
+        self.landmarks = list(landmarks)
+        self.lons = np.array([l.lon for l in self.landmarks], dtype=np.float64)
+        self.lats = np.array([l.lat for l in self.landmarks], dtype=np.float64)
+        self.tree = cKDTree(unit_vectors(self.lons, self.lats)
+                            .reshape(-1, 3))
+
+    def __len__(self):
+        return len(self.landmarks)
+
+    def _ball(self, lon, lat, radius):
+        c = (radius * SLACK + PAD) / SPHERE_RADIUS
+        if c >= math.pi:
+            return np.arange(len(self))
+        return np.array(self.tree.query_ball_point(
+            unit_vectors([lon], [lat])[0], 2 * math.sin(c / 2)),
+                        dtype=np.intp)
+
+    def within_disks(self, disks, scale=0):
+        """Return the landmarks within all of DISKS, a list of
+           (longitude, latitude, radius) triples, with each radius
+           increased by SCALE (all in meters).  Equivalent to an
+           ST_DWithin clause per disk on a GEOGRAPHY column."""
+        disks = [(lon, lat, rad + scale) for lon, lat, rad in disks]
+        if not disks:
+            return list(self.landmarks)
+        if any(rad < 0 for _, _, rad in disks):
+            return []
+
+        disks.sort(key = lambda d: d[2])
+        sel = self._ball(*disks[0])
+        for lon, lat, rad in disks:
+            if not len(sel):
+                break
+            _, _, dist = WGS84geod.inv(np.full(len(sel), lon),
+                                       np.full(len(sel), lat),
+                                       self.lons[sel], self.lats[sel])
+            sel = sel[dist <= rad]
+
+        return [self.landmarks[i] for i in sel]
+
+class LandmarkIndex:
+    """A LandmarkSet which is rebuilt, using LOAD (a function taking
+       no arguments and returning the landmarks), whenever STAMP_FILE
+       changes.  scripts/update_ripe_probes.py rewrites the stamp file
+       each time it finishes updating the database.  Without a stamp
+       file, or if it does not exist, the set is rebuilt every MAX_AGE
+       seconds instead.
+    """
+
+    def __init__(self, load, stamp_file=None, max_age=3600):
+        self.load = load
+        self.stamp_file = stamp_file
+        self.max_age = max_age
+        self.lock = threading.Lock()
+        self.lmset = None
+        self.last_load_time = 0
+        self.last_statprint = None
+
+    def get(self):
+        with self.lock:
+            self.maybe_reload_landmarks()
+            return self.lmset
+
+    def within_disks(self, disks, scale=0):
+        return self.get().within_disks(disks, scale)
+
+    def stamp_statprint(self):
+        if self.stamp_file is None:
+            return None
+        try:
+            st = os.stat(self.stamp_file)
+        except FileNotFoundError:
+            return None
+        return (st.st_dev, st.st_ino, st.st_size,
+                st.st_mtime_ns, st.st_ctime_ns)
+
+    def maybe_reload_landmarks(self):
+        now = time.monotonic()
+        stprint = self.stamp_statprint()
+        if self.lmset is not None:
+            if stprint is not None:
+                if stprint == self.last_statprint:
+                    return
+            elif now - self.last_load_time < self.max_age:
+                return
+
+        self.lmset = LandmarkSet(self.load())
+        self.last_load_time = now
+        self.last_statprint = stprint
@@ -20,11 +20,14 @@ from   urllib.parse import urljoin, urlencode
 
 from   ripe.atlas.sagan import PingResult
 import numpy as np
-from   scipy import optimize
 import requests
 import psycopg2
 from   psycopg2.extras import execute_values
 
+sys.path.append(os.path.join(os.path.dirname(os.path.dirname(
+    os.path.abspath(__file__))), 'lib'))
+from bestline import solve_bestline
+
 #
 # Utility
 #
@@ -594,7 +597,8 @@ def discard_infeasible(obs):
 
        An observation is infeasible if it implies a propagation speed
        faster than 200,000 km/s.  We also discard all observations at
-       distance < 1000m, because these tend to make 'linprog' barf.
+       distance < 1000m, because these tended to make the LP solver
+       formerly used here barf.
     """
     if len(obs.shape) != 2:
         raise ValueError("OBS should be a 2D matrix, not {}D"
@@ -640,17 +644,11 @@ def calibrate_cbg_for_block(sid, block):
     cx = np.append(dists, DISTANCE_LIMIT)
     cy = np.append(rtts, TIME_LIMIT)
 
-    coef = np.array([np.sum(cy), -np.sum(cx), -len(cx)])
-    constr_A = np.column_stack((
-        np.zeros_like(cx), cx, np.ones_like(cx)
-    ))
-    constr_B = np.column_stack((cy,))
-    bounds = [(1,1), (1/(100*1000), None), (0, np.amin(cy))]
-
-    fit = optimize.linprog(coef,
-                           A_ub=constr_A,
-                           b_ub=constr_B,
-                           bounds=bounds)
+    #
+    # Minimizing 1Y - mX - bI is the same as maximizing m(X/I) + b,
+    # which solve_bestline does directly.  Note that X and I include
+    # the artificial data point.
+    fit = solve_bestline(cx, cy, np.mean(cx), 1/(100*1000), np.amin(cy))
     if not fit.success:
         return []
 
@@ -724,10 +722,22 @@ def calibrate_cbg():
 # Master control
 #
 
+def write_stamp_file(fname):
+    """Atomically replace FNAME with a file recording the current time.
+       The web application rebuilds its landmark index whenever this
+       file changes."""
+    tmpname = fname + ".tmp"
+    with open(tmpname, "w") as fp:
+        fp.write(datetime.datetime.utcnow().isoformat() + "\n")
+    os.replace(tmpname, fname)
+
 def main():
     ap = argparse.ArgumentParser(description=__doc__)
     ap.add_argument("dbname",
                     help="Name of the database to record all information in.")
+    ap.add_argument("--stamp-file", metavar="FILE",
+                    help="File to rewrite when the update is complete, "
+                    "to tell the web application to reload the landmarks.")
     args = ap.parse_args()
 
     global _dbname
@@ -748,6 +758,8 @@ def main():
     pool.map(retrieve_anchor_ping_results, anchor_data, chunksize=40)
 
     calibrate_cbg()
+    if args.stamp_file:
+        write_stamp_file(args.stamp_file)
     progress("done")
 
 if __name__ == '__main__':